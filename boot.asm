@@ -71,13 +71,13 @@ higherhalf:
 	
 [global gdt_flush] ; make 'gdt_flush' accessible from C code
 [global idt_load] ; make 'idt_load' accessible from C code
-[extern gp]        ; tells the assembler to look at C code for 'gp'
 [extern iptr]        ; tells the assembler to look at C code for 'iptr'
  
 ; this function does the same thing of the 'start' one, this time with
-; the real GDT
+; the real GDT of a CPU, whose pointer is passed as a parameter
 gdt_flush:
-	lgdt [gp]			; load GDT pointer into register
+	mov eax, [esp+4]		; get the pointer to the GDT pointer
+	lgdt [eax]			; load GDT pointer into register
 	mov ax, 0x10		; load data selector onto all
 	mov ds, ax			; segment selectors
 	mov es, ax
@@ -0,0 +1,78 @@
+/* clock.c - Krypton clocksource
+ *
+ * The TSC frequency is measured by counting cycles while channel 2 of
+ * the PIT (the speaker one, which can be polled without interrupts)
+ * counts down CLOCK_CALIBRATE_MS milliseconds.
+ */
+
+#include "clock.h"
+#include "pmm.h"
+#include "common.h"
+#include "cpu.h"
+#include "kprintf.h"
+
+/***************************************
+ * Static Function Prototypes
+ ***************************************/
+static uint64_t clock_calibrate();
+
+/***************************************
+ * Globals
+ ***************************************/
+/* The kernel writes the page here, users read it at CLOCK_PAGE_ADDR */
+static clock_page_t clock_page __attribute__((aligned(4096)));
+
+/* clock_init() - calibrates the TSC and publishes the clock page
+ *
+ * frequency is the timer tick rate, used when there is no TSC
+ */
+void clock_init(uint32_t frequency) {
+    memset((uint8_t *) &clock_page, 0, sizeof (clock_page_t));
+    clock_page.ns_per_tick = 1000000000 / frequency;
+
+    if (cpuid_features() & CPUID_TSC) {
+        clock_page.tsc_hz = clock_calibrate();
+        clock_page.tsc_base = read_tsc();
+        clock_page.mult = (uint32_t)
+                (((uint64_t) 1000000000 << CLOCK_SHIFT) / clock_page.tsc_hz);
+        kprintf("TSC: %u kHz\n", (uint32_t) (clock_page.tsc_hz / 1000));
+    }
+
+    // Translate the page from virtual to physical address, like
+    // init_paging() does, and map it again read-only for the users
+    mm_map((phys_addr_t) ((unsigned long) &clock_page + 0x40000000),
+            (void *) CLOCK_PAGE_ADDR, PAGE_USER);
+}
+
+/* clock_tick() - advances the tick based fallback clock */
+void clock_tick() {
+    if (!clock_page.mult)
+        clock_page.ns_base += clock_page.ns_per_tick;
+}
+
+uint64_t ktime_ns() {
+    return clock_read_ns(&clock_page);
+}
+
+static uint64_t clock_calibrate() {
+    uint32_t count = 1193180 / (1000 / CLOCK_CALIBRATE_MS);
+    uint64_t start, end;
+    uint8_t gate;
+
+    // Speaker off, channel 2 gate low
+    gate = inb(0x61) & ~0x03;
+    outb(0x61, gate);
+    // Channel 2, lobyte/hibyte, interrupt on terminal count
+    outb(0x43, 0xB0);
+    outb(0x42, (uint8_t) (count & 0xFF));
+    outb(0x42, (uint8_t) ((count >> 8) & 0xFF));
+
+    // Raising the gate starts the count, bit 5 rises at its end
+    outb(0x61, gate | 0x01);
+    start = read_tsc();
+    while (!(inb(0x61) & 0x20));
+    end = read_tsc();
+    outb(0x61, gate);
+
+    return (end - start) * (1000 / CLOCK_CALIBRATE_MS);
+}
@@ -0,0 +1,58 @@
+/*
+ * File:   clock.h
+ * Author: renato
+ *
+ * High resolution clocksource. The TSC is calibrated against the PIT at
+ * boot, and the conversion parameters are kept in a page that user
+ * threads can read at CLOCK_PAGE_ADDR, so they get the time without
+ * a system call.
+ */
+
+#ifndef _CLOCK_H
+#define	_CLOCK_H
+
+#include "common.h"
+#include "cpu.h"
+
+#define CLOCK_PAGE_ADDR  (unsigned long) 0xFD000000 // Read-only user mapping
+#define CLOCK_SHIFT      24     // Fixed point shift of the cycles to ns factor
+#define CLOCK_CALIBRATE_MS 10   // Length of the calibration against the PIT
+
+/* Clocksource parameters, shared read-only with user threads.
+ * Without a usable TSC, mult is 0 and ns_base advances every tick. */
+typedef struct clock_page {
+    uint64_t tsc_base;          // TSC reading at boot
+    volatile uint64_t ns_base;  // Time at tsc_base
+    uint64_t tsc_hz;            // Calibrated TSC frequency
+    uint32_t mult;              // ns = cycles * mult >> CLOCK_SHIFT
+    uint32_t ns_per_tick;       // Tick length, for the tick based fallback
+} __attribute__((packed)) clock_page_t;
+
+/* Converts the TSC into monotonic nanoseconds since boot. The cycle
+ * count is split in two halves, so the product never overflows. */
+static inline uint64_t clock_read_ns(const clock_page_t *page)
+{
+    uint64_t delta;
+
+    if (!page->mult)
+        return page->ns_base;
+    delta = read_tsc() - page->tsc_base;
+    return page->ns_base +
+           (((delta >> 32) * page->mult) << (32 - CLOCK_SHIFT)) +
+           (((delta & 0xFFFFFFFF) * page->mult) >> CLOCK_SHIFT);
+}
+
+void clock_init(uint32_t frequency);
+
+void clock_tick();
+
+/* Kernel side time source */
+uint64_t ktime_ns();
+
+/* User side time source, through the shared page */
+static inline uint64_t uclock_ns()
+{
+    return clock_read_ns((const clock_page_t *) CLOCK_PAGE_ADDR);
+}
+
+#endif	/* _CLOCK_H */
@@ -36,6 +36,16 @@ void memset(uint8_t *dest, uint8_t val, uint32_t len)
   for ( ; len != 0; len--) *dest++ = val;
 }
 
+// Compare len bytes of two buffers. Returns 0 if they are equal,
+// or the difference of the first bytes that are not.
+int memcmp(const uint8_t *buf1, const uint8_t *buf2, uint32_t len)
+{
+  for ( ; len != 0; len--, buf1++, buf2++)
+    if (*buf1 != *buf2)
+      return *buf1 - *buf2;
+  return 0;
+}
+
 // Compare two strings. Should return -1 if
 // str1 < str2, 0 if they are equal or 1 otherwise.
 int strcmp(char *str1, char *str2)
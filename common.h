@@ -23,6 +23,8 @@ extern struct sys_base_t * sys_base;
 
 // Some standard typedefs, to standardise sizes across platforms.
 // These typedefs are written for 32-bit X86.
+typedef unsigned long long uint64_t;
+typedef          long long int64_t;
 typedef unsigned int   uint32_t;
 typedef          int   int32_t;
 typedef unsigned short uint16_t;
@@ -78,6 +80,7 @@ uint8_t inb(uint16_t port);
 uint16_t inw(uint16_t port);
 void memcpy(uint8_t *dest, const uint8_t *src, uint32_t len);
 void memset(uint8_t *dest, uint8_t val, uint32_t len);
+int memcmp(const uint8_t *buf1, const uint8_t *buf2, uint32_t len);
 char *strcpy(char *dest, const char *src);
 char *strcat(char *dest, const char *src);
 int strlen(char *src);
@@ -8,21 +8,18 @@
  */
 
 #include "cpu.h"
+#include "smp.h"
 
-// We'll need at least 6 entries in our GDT...
-
-struct gdt_entry gdt[6];
-struct gdt_ptr gp;
+// Every CPU has its own GDT, in its cpu_t
 
 struct idt_entry idt[256];
 struct idt_ptr iptr;
 
-tss_entry_t tss_entry;
-
 // Extern assembler function
-extern void gdt_flush();
+extern void gdt_flush(struct gdt_ptr *gp);
 extern void idt_load();
 extern void tss_flush();
+extern void sysenter_entry();
 
 extern unsigned int user_stack_top;
 
@@ -34,11 +31,50 @@ void disable(){
     asm volatile ("cli");
 }
 
-static void write_tss(int num, uint16_t ss0, uint32_t esp0);
+uint32_t cpuid_features(){
+    uint32_t eax = 1, ebx, ecx, edx;
+    asm volatile ("cpuid" : "+a" (eax), "=b" (ebx), "=c" (ecx), "=d" (edx));
+    return edx;
+}
+
+uint64_t read_tsc(){
+    uint32_t lo, hi;
+    asm volatile ("rdtsc" : "=a" (lo), "=d" (hi));
+    return ((uint64_t) hi << 32) | lo;
+}
+
+void write_msr(uint32_t msr, uint64_t value){
+    asm volatile ("wrmsr" :: "c" (msr), "a" ((uint32_t) value),
+                  "d" ((uint32_t) (value >> 32)));
+}
+
+int sysenter_supported(){
+    uint32_t eax = 1, ebx, ecx, edx;
+    asm volatile ("cpuid" : "+a" (eax), "=b" (ebx), "=c" (ecx), "=d" (edx));
+    if(!(edx & CPUID_SEP))
+        return 0;
+    // The early Pentium Pro reports SEP, but has no sysenter
+    if(((eax >> 8) & 0xF) == 6 && ((eax >> 4) & 0xF) < 3 && (eax & 0xF) < 3)
+        return 0;
+    return 1;
+}
+
+// The entry finds the kernel stack of the running thread in the TSS:
+// SYSENTER_ESP points at the esp0 field, which set_kernel_stack() updates
+void sysenter_install(cpu_t *cpu){
+    if(!sysenter_supported())
+        return;
+    write_msr(MSR_SYSENTER_CS, 0x08);
+    write_msr(MSR_SYSENTER_ESP,
+              (uint32_t) &cpu->tss + offsetof(tss_entry_t, esp0));
+    write_msr(MSR_SYSENTER_EIP, (uint32_t) sysenter_entry);
+}
+
+static void write_tss(cpu_t *cpu, int num, uint16_t ss0, uint32_t esp0);
 
 // Very simple: fills a GDT entry using the parameters
-static void gdt_set_gate(int num, unsigned long base, unsigned long limit,
-        unsigned char access, unsigned char gran)
+static void gdt_set_gate(struct gdt_entry *gdt, int num, unsigned long base,
+        unsigned long limit, unsigned char access, unsigned char gran)
 {
 	gdt[num].base_low = (base & 0xFFFF);
 	gdt[num].base_middle = (base >> 16) & 0xFF;
@@ -51,21 +87,29 @@ static void gdt_set_gate(int num, unsigned long base, unsigned long limit,
 	gdt[num].access = access;
 }
 
-// Sets our 3 gates and installs the real GDT through the assembler function
-void gdt_install()
+// Sets the gates of a CPU and installs its GDT through the assembler function
+void gdt_install(cpu_t *cpu)
 {
-	gp.limit = (sizeof(struct gdt_entry) * 6) - 1;
-	gp.base = (unsigned int)&gdt;
+	cpu->gp.limit = (sizeof(struct gdt_entry) * GDT_ENTRIES) - 1;
+	cpu->gp.base = (unsigned int)&cpu->gdt;
 	
-	gdt_set_gate(0, 0, 0, 0, 0);
-	gdt_set_gate(1, 0, 0xFFFFFFFF, 0x9A, 0xCF);
-	gdt_set_gate(2, 0, 0xFFFFFFFF, 0x92, 0xCF);
-        gdt_set_gate(3, 0, 0xFFFFFFFF, 0xFA, 0xCF); // User mode code segment
-        gdt_set_gate(4, 0, 0xFFFFFFFF, 0xF2, 0xCF); // User mode data segment
-        write_tss(5, 0x10, 0x0);
+	gdt_set_gate(cpu->gdt, 0, 0, 0, 0, 0);
+	gdt_set_gate(cpu->gdt, 1, 0, 0xFFFFFFFF, 0x9A, 0xCF);
+	gdt_set_gate(cpu->gdt, 2, 0, 0xFFFFFFFF, 0x92, 0xCF);
+        gdt_set_gate(cpu->gdt, 3, 0, 0xFFFFFFFF, 0xFA, 0xCF); // User mode code segment
+        gdt_set_gate(cpu->gdt, 4, 0, 0xFFFFFFFF, 0xF2, 0xCF); // User mode data segment
+        write_tss(cpu, 5, 0x10, 0x0);
+        // Per-CPU data segment, based on the cpu_t. Ring 3 gets a read-only
+        // view of it, so this_cpu() works everywhere but only the kernel
+        // can change the cpu_t
+        gdt_set_gate(cpu->gdt, 6, (unsigned long) cpu, sizeof(cpu_t) - 1, 0x92, 0x40);
+        gdt_set_gate(cpu->gdt, 7, (unsigned long) cpu, sizeof(cpu_t) - 1, 0xF0, 0x40);
+        cpu->self = cpu;
 	
-	gdt_flush();
+	gdt_flush(&cpu->gp);
         tss_flush();
+        asm volatile ("mov %0, %%gs" :: "r" (CPU_SELECTOR));
+        sysenter_install(cpu);
 }
 
 void idt_install()
@@ -85,20 +129,21 @@ void idt_install()
 }
 
 // Initialise our task state segment structure.
-static void write_tss(int num, uint16_t ss0, uint32_t esp0)
+static void write_tss(cpu_t *cpu, int num, uint16_t ss0, uint32_t esp0)
 {
+   tss_entry_t *tss_entry = &cpu->tss;
    // Firstly, let's compute the base and limit of our entry into the GDT.
-   uint32_t base = (uint32_t) &tss_entry;
-   uint32_t limit = base + sizeof(tss_entry);
+   uint32_t base = (uint32_t) tss_entry;
+   uint32_t limit = base + sizeof(tss_entry_t);
 
    // Now, add our TSS descriptor's address to the GDT.
-   gdt_set_gate(num, base, limit, 0xE9, 0x00);
+   gdt_set_gate(cpu->gdt, num, base, limit, 0xE9, 0x00);
 
    // Ensure the descriptor is initially zero.
-   memset(&tss_entry, 0, sizeof(tss_entry));
+   memset((uint8_t *) tss_entry, 0, sizeof(tss_entry_t));
 
-   tss_entry.ss0  = ss0;  // Set the kernel stack segment.
-   tss_entry.esp0 = esp0; // Set the kernel stack pointer.
+   tss_entry->ss0  = ss0;  // Set the kernel stack segment.
+   tss_entry->esp0 = esp0; // Set the kernel stack pointer.
 
    // Here we set the cs, ss, ds, es, fs and gs entries in the TSS. These specify what
    // segments should be loaded when the processor switches to kernel mode. Therefore
@@ -106,11 +151,11 @@ static void write_tss(int num, uint16_t ss0, uint32_t esp0)
    // but with the last two bits set, making 0x0b and 0x13. The setting of these bits
    // sets the RPL (requested privilege level) to 3, meaning that this TSS can be used
    // to switch to kernel mode from ring 3.
-   tss_entry.cs   = 0x0b;
-   tss_entry.ss = tss_entry.ds = tss_entry.es = tss_entry.fs = tss_entry.gs = 0x13;
+   tss_entry->cs   = 0x0b;
+   tss_entry->ss = tss_entry->ds = tss_entry->es = tss_entry->fs = tss_entry->gs = 0x13;
 }
 
 void set_kernel_stack(uint32_t stack) //this will update the ESP0 stack used when an interrupt occurs
 {
-   tss_entry.esp0 = stack;
+   this_cpu()->tss.esp0 = stack;
 }
\ No newline at end of file
@@ -7,8 +7,16 @@
  *
  */
 
+#ifndef _CPU_H
+#define	_CPU_H
+
 #include "common.h"
 
+// Null, kernel code/data, user code/data, TSS and the per-CPU segments
+#define GDT_ENTRIES 8
+
+struct cpu_s;
+
 // Defines the structures of a GDT entry and of a GDT pointer
 
 struct gdt_entry
@@ -86,9 +94,10 @@ void init_paging();
 
 /*******************************************************************
  get_install()
- Sets our 3 gates and installs the real GDT through the assembler function
+ Sets the gates of a CPU and installs its GDT through the assembler
+ function, then loads its TSS and per-CPU segment
  *******************************************************************/
-void gdt_install();
+void gdt_install(struct cpu_s *cpu);
 
 /*******************************************************************
  enable(), disable()
@@ -99,3 +108,43 @@ void enable();
 void disable();
 
 void set_kernel_stack(uint32_t stack);
+
+/*******************************************************************
+ cpuid_features()
+ Returns the feature flags (EDX) of CPUID leaf 1
+ *******************************************************************/
+#define CPUID_PSE   (1 << 3)
+#define CPUID_TSC   (1 << 4)
+#define CPUID_PAE   (1 << 6)
+#define CPUID_APIC  (1 << 9)
+#define CPUID_SEP   (1 << 11)
+#define CPUID_PGE   (1 << 13)
+
+uint32_t cpuid_features();
+
+/*******************************************************************
+ read_tsc()
+ Reads the processor time-stamp counter
+ *******************************************************************/
+uint64_t read_tsc();
+
+/*******************************************************************
+ write_msr()
+ Writes a model specific register
+ *******************************************************************/
+#define MSR_SYSENTER_CS     0x174
+#define MSR_SYSENTER_ESP    0x175
+#define MSR_SYSENTER_EIP    0x176
+
+void write_msr(uint32_t msr, uint64_t value);
+
+/*******************************************************************
+ sysenter_supported(), sysenter_install()
+ Tells if the processor has a working sysenter, and points the
+ sysenter MSRs of a CPU at the fast system call entry
+ *******************************************************************/
+int sysenter_supported();
+
+void sysenter_install(struct cpu_s *cpu);
+
+#endif	/* _CPU_H */
@@ -0,0 +1,150 @@
+/* deadline.c - Krypton deadline scheduling class
+ *
+ * Admission control and the constant bandwidth server rules. The run
+ * queues keep the deadline threads sorted (thread.c), the CPUs charge
+ * the running one on every tick (timer.c).
+ */
+
+#include "deadline.h"
+#include "sysbase.h"
+#include "clock.h"
+#include "smp.h"
+#include "syscall.h"
+
+/***************************************
+ * Static Function Prototypes
+ ***************************************/
+static cpu_t * dl_admit(thread_t *thread, uint32_t bw);
+
+/* system call wrapper to make the running thread a deadline thread.
+   A runtime of 0 makes it a normal thread again. Returns -1 if the
+   parameters are wrong or the thread cannot be admitted */
+int set_deadline(uint32_t runtime_us, uint32_t deadline_us, uint32_t period_us)
+{
+    return (int) do_syscall(SYS_SET_DEADLINE, runtime_us, deadline_us, period_us);
+}
+
+/* _set_deadline() - sets the deadline parameters of a thread
+ *
+ * A deadline of 0 stands for the period. The thread is admitted on its
+ * own CPU if there is room, otherwise on another allowed one (unless it
+ * is running), and it stays pinned there. Returns 0, or -1 if it was not
+ * admitted; its parameters are left as they were then.
+ */
+int _set_deadline(thread_t *thread, uint32_t runtime_us, uint32_t deadline_us,
+        uint32_t period_us) {
+    uint64_t runtime = (uint64_t) runtime_us * 1000;
+    uint64_t deadline = (uint64_t) (deadline_us ? deadline_us : period_us) * 1000;
+    uint64_t period = (uint64_t) period_us * 1000;
+    cpu_t * cpu = &cpus[thread->cpu];
+    uint32_t bw = 0;
+    int queued;
+
+    if (runtime) {
+        if (!period || runtime > deadline || deadline > period)
+            return -1;
+        bw = (uint32_t) ((runtime << DL_BW_SHIFT) / deadline);
+        if (!(cpu = dl_admit(thread, bw)))
+            return -1;
+    }
+
+    // Leave the run queue while the class and the CPU change
+    queued = (thread->thread_flags & TS_READY) &&
+             thread != cpus[thread->cpu].running_thread;
+    if (queued)
+        rq_remove(&cpus[thread->cpu].thread_ready, thread);
+    cpus[thread->cpu].dl_bw -= thread->dl.bw;
+
+    thread->dl.runtime = runtime;
+    thread->dl.deadline = deadline;
+    thread->dl.period = period;
+    thread->dl.bw = bw;
+    if (runtime) {
+        cpu->dl_bw += bw;
+        if (cpu->id != thread->cpu)
+            cpu->migrations++;
+        thread->cpu = cpu->id;
+        thread->affinity = 1 << cpu->id;
+        // Start a new period right away
+        thread->dl.stamp = ktime_ns();
+        thread->dl.abs_deadline = thread->dl.stamp + deadline;
+        thread->dl.budget = (int64_t) runtime;
+    } else {
+        thread->affinity = CPU_AFFINITY_ALL;
+    }
+
+    if (queued)
+        rq_add(&cpu->thread_ready, thread);
+    smp_reschedule(cpu);
+    return 0;
+}
+
+/* dl_charge() - charges the time run since the last charge to the budget
+ *
+ * A throttled thread still running (nothing else was ready) is
+ * replenished once its deadline passed. Returns 1 if it is out of budget.
+ */
+int dl_charge(thread_t *thread) {
+    uint64_t now = ktime_ns();
+
+    thread->dl.budget -= (int64_t) (now - thread->dl.stamp);
+    thread->dl.stamp = now;
+    if (thread->dl.budget > 0)
+        return 0;
+    if (now >= thread->dl.abs_deadline)
+        dl_replenish(thread);
+    return thread->dl.budget <= 0;
+}
+
+/* dl_replenish() - refills the budget, for the next period
+ *
+ * An overrun is paid back from the following budgets.
+ */
+void dl_replenish(thread_t *thread) {
+    if (thread->dl.budget <= 0)
+        thread->dl.overruns++;
+    do {
+        thread->dl.budget += (int64_t) thread->dl.runtime;
+        thread->dl.abs_deadline += thread->dl.period;
+    } while (thread->dl.budget <= 0);
+}
+
+/* dl_wakeup() - CBS wakeup rule, for a deadline thread being readied
+ *
+ * The current deadline is kept only if the budget left can be used
+ * before it without exceeding the bandwidth, otherwise a new period
+ * starts now. A throttled thread stays throttled until its deadline.
+ */
+void dl_wakeup(thread_t *thread) {
+    uint64_t now = ktime_ns();
+
+    if (thread->dl.abs_deadline <= now ||
+        (thread->dl.budget > 0 && (uint64_t) thread->dl.budget >
+         (((thread->dl.abs_deadline - now) * thread->dl.bw) >> DL_BW_SHIFT))) {
+        thread->dl.abs_deadline = now + thread->dl.deadline;
+        thread->dl.budget = (int64_t) thread->dl.runtime;
+    }
+}
+
+/* dl_admit() - CPU a deadline thread of bandwidth bw fits in, or NULL
+ *
+ * The bandwidth the thread already has is given back first. A running
+ * thread can only be admitted on its own CPU.
+ */
+static cpu_t * dl_admit(thread_t *thread, uint32_t bw) {
+    cpu_t * cpu = &cpus[thread->cpu];
+    uint32_t i;
+
+    if (cpu->dl_bw - thread->dl.bw + bw <= DL_BW_MAX)
+        return cpu;
+    if (thread == cpu->running_thread)
+        return NULL;
+    for (i = 0; i < MAX_CPUS; i++) {
+        cpu = &cpus[i];
+        if (!cpu->online || i == thread->cpu || !(thread->affinity & (1 << i)))
+            continue;
+        if (cpu->dl_bw + bw <= DL_BW_MAX)
+            return cpu;
+    }
+    return NULL;
+}
@@ -0,0 +1,40 @@
+/*
+ * File:   deadline.h
+ * Author: renato
+ *
+ * Deadline scheduling class, for the multimedia threads.
+ *
+ * A thread declares a runtime, a relative deadline and a period. It is
+ * admitted on a CPU only if the bandwidths (runtime / deadline) of the
+ * deadline threads there stay below DL_BW_MAX, and it is pinned to that
+ * CPU. Every CPU runs its deadline threads earliest deadline first (EDF),
+ * ahead of all the normal priorities.
+ *
+ * Every deadline thread is a constant bandwidth server (CBS): the time it
+ * runs is charged to its budget. A thread that runs out of budget is
+ * throttled until its deadline, then replenished with the next period,
+ * so an overrunning thread cannot steal the time of the others.
+ */
+
+#ifndef _DEADLINE_H
+#define	_DEADLINE_H
+
+#include "common.h"
+#include "thread.h"
+
+#define DL_BW_SHIFT     20  // Fixed point shift of the bandwidths
+#define DL_BW_UNIT      (1 << DL_BW_SHIFT)  // A whole CPU
+#define DL_BW_MAX       (DL_BW_UNIT * 95 / 100) // Left to the normal threads: 5%
+
+int set_deadline(uint32_t runtime_us, uint32_t deadline_us, uint32_t period_us);
+
+int _set_deadline(thread_t *thread, uint32_t runtime_us, uint32_t deadline_us,
+        uint32_t period_us);
+
+int dl_charge(thread_t *thread);
+
+void dl_replenish(thread_t *thread);
+
+void dl_wakeup(thread_t *thread);
+
+#endif	/* _DEADLINE_H */
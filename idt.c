@@ -11,6 +11,7 @@
 #include "sysbase.h"
 #include "cpu.h"
 #include "message.h"
+#include "smp.h"
 
 
 
@@ -107,6 +108,11 @@ void init_idt() {
     idt_set_gate(45, (uint32_t) irq13, 0x08, 0x8E);
     idt_set_gate(46, (uint32_t) irq14, 0x08, 0x8E);
     idt_set_gate(47, (uint32_t) irq15, 0x08, 0x8E);
+    // Local APIC interrupts
+    idt_set_gate(IRQ_LAPIC_TIMER, (uint32_t) irq16, 0x08, 0x8E);
+    idt_set_gate(IRQ_RESCHEDULE, (uint32_t) irq17, 0x08, 0x8E);
+    idt_set_gate(IRQ_TLB_SHOOTDOWN, (uint32_t) isr_tlb_shootdown, 0x08, 0x8E);
+    idt_set_gate(IRQ_SPURIOUS, (uint32_t) isr_spurious, 0x08, 0x8E);
     idt_set_gate(255, (uint32_t) isr255, 0x08, 0x8E);
 
 
@@ -114,6 +120,12 @@ void init_idt() {
     idt_flush((uint32_t) & idt_ptr);
 }
 
+// The application processors share the IDT of the boot one.
+
+void idt_reload() {
+    idt_flush((uint32_t) & idt_ptr);
+}
+
 static void idt_set_gate(uint8_t num, uint32_t base, uint16_t sel, uint8_t flags) {
     idt_entries[num].base_lo = base & 0xFFFF;
     idt_entries[num].base_hi = (base >> 16) & 0xFFFF;
@@ -130,14 +142,15 @@ static void idt_set_gate(uint8_t num, uint32_t base, uint16_t sel, uint8_t flags
 // And only involves a system call or an severe error
 
 void idt_handler(registers_t *regs) {
-    sys_base->k_reenter++;
+    this_cpu()->k_reenter++;
+    smp_lock();
     if (interrupt_handlers [regs->int_no]) {
         interrupt_handlers [regs->int_no] (regs);
-        if ((sys_base->sys_flags & NEED_SCHEDULE) != 0 &&
-            (sys_base->k_reenter <= 0)) {
+        if ((this_cpu()->sys_flags & NEED_SCHEDULE) != 0 &&
+            (this_cpu()->k_reenter <= 0)) {
             // Check the "schedule needed" flag
             // If the flag is set, clear it and call the scheduler
-            sys_base->sys_flags &= (~NEED_SCHEDULE);
+            this_cpu()->sys_flags &= (~NEED_SCHEDULE);
             schedule();
         }
     } else {
@@ -153,7 +166,8 @@ void register_interrupt_handler(uint8_t n, interrupt_handler_t h) {
 
 void irq_handler(registers_t *regs) {
     except_t * except_ptr;
-    sys_base->k_reenter++;
+    this_cpu()->k_reenter++;
+    smp_lock();
 
     // Call the interrupt request kernel handler function
     if (interrupt_handlers[regs->int_no] != 0) {
@@ -161,20 +175,25 @@ void irq_handler(registers_t *regs) {
     } else {
         panic("Unhandled hardware interrupt.\n");
     }
-    // Send an EOI (end of interrupt) signal to the PICs.
-    // If this interrupt involved the slave.
-    if (regs->int_no >= 40) {
-        // Send reset signal to slave.
-        outb(0xA0, 0x20);
+    // The local APIC interrupts are acknowledged to the APIC
+    if (regs->int_no >= IRQ_LAPIC_TIMER) {
+        lapic_eoi();
+    } else {
+        // Send an EOI (end of interrupt) signal to the PICs.
+        // If this interrupt involved the slave.
+        if (regs->int_no >= 40) {
+            // Send reset signal to slave.
+            outb(0xA0, 0x20);
+        }
+        // Send reset signal to master. (As well as slave, if necessary).
+        outb(0x20, 0x20);
     }
-    // Send reset signal to master. (As well as slave, if necessary).
-    outb(0x20, 0x20);
 
     // Check the "schedule needed" flag
     // If the flag is set, clear it and call the scheduler
-    if ((sys_base->sys_flags & NEED_SCHEDULE) != 0 &&
-        (sys_base->k_reenter <= 0)) {
-        sys_base->sys_flags &= (~NEED_SCHEDULE);
+    if ((this_cpu()->sys_flags & NEED_SCHEDULE) != 0 &&
+        (this_cpu()->k_reenter <= 0)) {
+        this_cpu()->sys_flags &= (~NEED_SCHEDULE);
         schedule();
     }
 }
@@ -72,6 +72,9 @@ void register_interrupt_handler (uint8_t n, interrupt_handler_t h);
 // IDT initialisation function.
 void init_idt ();
 
+// Loads the IDT on an application processor.
+void idt_reload ();
+
 // These extern directives let us access the addresses of our ASM ISR handlers.
 extern void isr0 ();
 extern void isr1 ();
@@ -122,6 +125,10 @@ extern void irq12();
 extern void irq13();
 extern void irq14();
 extern void irq15();
+extern void irq16();
+extern void irq17();
+extern void isr_spurious();
+extern void isr_tlb_shootdown();
 
 #endif
 
@@ -3,7 +3,11 @@
 ;          Based on code from Bran's kernel development tutorials.
 ;          Rewritten for JamesM's kernel development tutorials.
 
-[extern sys_base]
+[extern cr3_reloads]
+[extern smp_unlock]
+
+%define CPU_SELECTOR 0x30    ; Per-CPU data segment, see smp.h
+%define CPU_USER_SELECTOR 0x3B ; Its read-only view for ring 3
 
 global idt_flush:function idt_flush.end-idt_flush ; Allows the C code to call idt_flush().
 idt_flush:
@@ -85,6 +89,7 @@ isr_common_stub:
     mov ds, ax
     mov es, ax
     mov fs, ax
+    mov ax, CPU_SELECTOR     ; and the per-CPU segment
     mov gs, ax
 
     push esp    	     ; Push a pointer to the current top of stack - this becomes the registers_t* parameter.
@@ -122,6 +127,38 @@ IRQ  12,    44
 IRQ  13,    45
 IRQ  14,    46
 IRQ  15,    47
+IRQ  16,    48               ; Local APIC timer
+IRQ  17,    49               ; Reschedule IPI
+
+; Spurious interrupts of the local APIC need no EOI
+global isr_spurious
+isr_spurious:
+    iret
+
+; TLB shootdown IPI. It must not wait for the kernel lock, the CPU
+; asking for it holds it, so it does not go through the dispatcher
+extern smp_tlb_interrupt
+global isr_tlb_shootdown
+isr_tlb_shootdown:
+    pusha
+    push ds
+    push es
+    push fs
+    push gs
+    mov ax, 0x10             ; Kernel data segments
+    mov ds, ax
+    mov es, ax
+    mov fs, ax
+    mov ax, CPU_SELECTOR     ; and the writable per-CPU segment
+    mov gs, ax
+    cld
+    call smp_tlb_interrupt
+    pop gs
+    pop fs
+    pop es
+    pop ds
+    popa
+    iret
         
 ; C function in idt.c
 extern irq_handler
@@ -142,6 +179,7 @@ irq_common_stub:
     mov ds, ax
     mov es, ax
     mov fs, ax
+    mov ax, CPU_SELECTOR     ; and the per-CPU segment
     mov gs, ax
 
     push esp    	         ; Push a pointer to the current top of stack
@@ -152,6 +190,73 @@ irq_common_stub:
     jmp dispatch           ; Drop into the dispatcher
 .end:
 
+;***************************************************
+; Fast system call entry, through sysenter.
+; The call number comes in eax, the arguments in ebx, esi and
+; edi, the user stack in ecx and the return address in edx.
+; The frame of an int 0xFF is built, with the 2nd and 3rd
+; arguments where the C code expects them, so a call that
+; blocks leaves through the dispatcher like any other.
+;***************************************************
+global sysenter_entry
+sysenter_entry:
+    mov esp, [esp]           ; SYSENTER_ESP points at the esp0 of the TSS
+    push 0x23                ; User stack segment
+    push ecx                 ; User stack pointer
+    pushf                    ; Flags, the interrupts were on in ring 3
+    or dword [esp], 0x200
+    push 0x1B                ; User code segment
+    push edx                 ; Return address
+    push 0                   ; No error code
+    push 255                 ; As if through int 0xFF
+    push eax                 ; The pusha layout, with the 2nd and 3rd
+    push esi                 ; arguments in the ecx and edx slots
+    push edi
+    push ebx
+    push 0                   ; esp, skipped by popa
+    push ebp
+    push esi
+    push edi
+    push 0x23                ; User data segment
+
+    mov ax, 0x10             ; Load the kernel data segment descriptor
+    mov ds, ax
+    mov es, ax
+    mov fs, ax
+    mov ax, CPU_SELECTOR     ; and the per-CPU segment
+    mov gs, ax
+
+    push esp                 ; registers_t* parameter
+    call idt_handler
+    add esp, 4
+
+    mov ebp, [gs:12]         ; Get the cpu_t of this processor
+    test dword [ebp], 4      ; Blocked or preempted (NEED_TASK_SWITCH)?
+    jnz dispatch             ; Then leave the slow way, through iret
+    sub dword [ebp+8], 1     ; Decrement k_reenter, back to ring 3
+    call smp_unlock          ; Give the kernel lock back
+    pop ebx                  ; Reload the user data segments
+    mov ds, bx
+    mov es, bx
+    mov fs, bx
+    mov bx, CPU_USER_SELECTOR ; sysexit keeps gs, hand the user view back
+    mov gs, bx
+    pop edi
+    pop esi
+    pop ebp
+    add esp, 4               ; Skip esp
+    pop ebx
+    add esp, 8               ; Skip the argument slots
+    pop eax                  ; Return value
+    add esp, 8               ; Skip the interrupt number and error code
+    pop edx                  ; Return address, for sysexit
+    add esp, 4               ; Skip cs
+    and dword [esp], 0xFFFFFDFF ; Restore the flags, interrupts still off
+    popf
+    pop ecx                  ; User stack pointer, for sysexit
+    sti                      ; Only takes effect after sysexit
+    sysexit
+
 GLOBAL tss_flush   ; Allows our C code to call tss_flush().
 tss_flush:
    mov ax, 0x2B      ; Load the index of our TSS structure - The index is
@@ -167,8 +272,9 @@ enter_user_mode:
      mov ax,0x23
      mov ds,ax
      mov es,ax
-     mov fs,ax
-     mov gs,ax ;we don't need to worry about SS. it's handled by iret
+     mov fs,ax ;we don't need to worry about SS. it's handled by iret
+     mov ax,CPU_USER_SELECTOR
+     mov gs,ax ;gs keeps pointing to the cpu_t in ring 3 too, read-only
 
      mov eax,esp
      push 0x23 ;user data segment with bottom 2 bits set for ring 3
@@ -187,7 +293,7 @@ user_mode:
 ; Here comes the code to dispatch a thread!
 ;***************************************************
 dispatch:
-    mov ebp, [sys_base]      ; Dereference sys_base pointer
+    mov ebp, [gs:12]         ; Get the cpu_t of this processor
     mov eax, [ebp+8]         ; Read k_reenter
     cmp eax, 0               ; If k_reenter > 0
     jne no_switch            ; Must NOT switch tasks!
@@ -204,7 +310,12 @@ was_halt:
     mov eax, [ebp+4]         ; Fetch the NEW running_thread node
     mov esp, [eax+40]        ; Restore new kernel-mode stack pointer
     mov ebx, [eax+24]        ; Retrieve the new thread's page directory
-    mov cr3, ebx             ; and load it into CR3
+    mov ecx, cr3             ; If it is already loaded, keep the TLB
+    cmp ebx, ecx
+    je same_pd
+    mov cr3, ebx             ; Otherwise load it into CR3
+    lock inc dword [cr3_reloads] ; and count the reload
+same_pd:
     mov ebx, [eax+28]        ; Get NEW the thread flags
     bt ebx, 4                ; Test if the flag TB_LAUNCH is set
     jnc no_launch            ; Skip thread launching code if not set
@@ -224,24 +335,33 @@ was_halt:
     push 0x1B                ; Push the user code segment selector
     mov ebx, [eax+32]        ; Get the starting eip of the thread
     push ebx                 ; Store it on the stack for iret to fetch
+    and dword [eax+28], 0xFFFFFFEF ; Clear the TB_LAUNCH flag
     sub dword [ebp+8], 1     ; Decrement k_reenter
+    call smp_unlock          ; Back to ring 3: give the kernel lock back
     mov ebp, 0               ; Clear the base pointer
     mov bx, 0x23             ; Load the remaining user segment selectors
     mov ds, bx
     mov es, bx
     mov fs, bx
+    mov bx, CPU_USER_SELECTOR ; and the read-only view of the cpu_t
     mov gs, bx
-    and dword [eax+28], 0xFFFFFFEF ; Clear the TB_LAUNCH flag
     jmp launch              ; Launch the new thread!
 no_launch:
     and dword [eax+28], 0xFFFFFFE7 ; Clear the TB_LAUNCH and TB_EXCEPT flags
 no_switch:                  ; Jumps here if no thread switch needed
     sub dword [ebp+8], 1     ; Decrement k_reenter
+    jns keep_lock            ; Still in the kernel?
+    call smp_unlock          ; If not, give the kernel lock back
+keep_lock:
     pop ebx                  ; Reload the original data segment descriptor
     mov ds, bx
     mov es, bx
     mov fs, bx
+    cmp bx, 0x10             ; Back to ring 3?
+    je kernel_gs
+    mov bx, CPU_USER_SELECTOR ; Then only with the read-only view of the cpu_t
     mov gs, bx
+kernel_gs:
     popa                     ; Restore the thread's context
     add esp, 8               ; Cleans up the pushed error code and pushed ISR number
 launch:
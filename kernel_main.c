@@ -19,8 +19,13 @@
 #include "idt.h"
 #include "thread.h"
 #include "timer.h"
+#include "clock.h"
 #include "panic.h"
 #include "message.h"
+#include "smp.h"
+#include "semaphore.h"
+#include "deadline.h"
+#include "syscall.h"
 
 /* Check if the compiler thinks if we are targeting the wrong operating system. */
 #if defined(__linux__)
@@ -85,7 +90,6 @@ void protection_fault(registers_t *regs);
 
 void keypress(registers_t *regs);
 int keypress_excp_handler(void * data);
-void syscall(registers_t *regs);
 
 char * kernel_thread_name = "krypton.library";
 
@@ -106,13 +110,15 @@ char * kernel_thread_name = "krypton.library";
 void init(multiboot_t * boot_info) {
     except_t * test;
     thread_t * keyboard_thread;
+    int i;
     // Initialize the memory manager and interrupts
     mm_init(boot_info);
     kernel_elf = elf_from_multiboot(boot_info);
 
     monitor_init();
+    boot_phase("console");
     sys_base->forbid_counter = 1;
-    sys_base->sys_flags = 0;
+    this_cpu()->sys_flags = 0;
 
     // Begin initializing the multithreading system
     // First initialize all the system's lists
@@ -122,46 +128,57 @@ void init(multiboot_t * boot_info) {
     new_list((list_head_t*)&sys_base->msgport_list);
     new_list((list_head_t*)&sys_base->resources_list);
     new_list((list_head_t*)&sys_base->semaphore_list);
-    new_list((list_head_t*)&sys_base->thread_ready);
+    for (i = 0; i < MAX_CPUS; i++)
+        rq_init(&cpus[i].thread_ready, i);
+    name_init();
     new_list((list_head_t*)&sys_base->thread_wait);
 
+    // Create the object caches for the most used kernel objects
+    sys_base->thread_cache = kmem_cache_create("thread_t", sizeof(thread_t), 4, thread_ctor);
+    if(!sys_base->thread_cache)
+        panic("can't create the thread cache");
+
     // No flags must be set
-    sys_base->sys_flags = 0;
+    this_cpu()->sys_flags = 0;
 
     // Now we will prepare the first thread of the system - the kernel thread
-    kernel_thread = (thread_t*) kmalloc(sizeof(thread_t));
+    if(!(kernel_thread = (thread_t*) kmem_cache_alloc(sys_base->thread_cache)))
+        panic("can't allocate the kernel thread");
 
     kernel_thread->node.name = kernel_thread_name; // Set as krypton.library
     kernel_thread->node.pri = 0; // Set priority
-    kernel_thread->node.type = NT_THREAD;   // Set node type
-    new_list((list_head_t *)&kernel_thread->msg_port); // Set message port
+    name_register((list_node_t *) kernel_thread);
+    init_msg_port(&kernel_thread->msg_port); // Set message port
     kernel_thread->thread_flags = TS_RUN; // Set status to running
     kernel_thread->uid = 0;
+    kernel_thread->affinity = CPU_AFFINITY_ALL;
     kernel_thread->init_kernel_esp = (uint32_t) kmalloc(4000) + 4000;
     set_kernel_stack(kernel_thread->init_kernel_esp);
 
     // Set the actual running thread as the kernel thread
-    sys_base->running_thread = kernel_thread;
+    this_cpu()->running_thread = kernel_thread;
     // Set the timeslicing quantum
     sys_base->std_ts_quantum = STD_TS_QUANTUM;
-    sys_base->ts_curr_count = STD_TS_QUANTUM;
+    this_cpu()->ts_curr_count = STD_TS_QUANTUM;
 
 
-    sys_base->act_page_directory = kernel_thread->page_directory = kernelpagedirPtr;
+    this_cpu()->act_page_directory = kernel_thread->page_directory = kernelpagedirPtr;
     
     register_interrupt_handler(13, &protection_fault);
     register_interrupt_handler(IRQ1, &keypress);
-    register_interrupt_handler(255, &syscall);
+    syscall_init();
     
     // This will be an historic moment: we turn the interrupts on and enter
     // ring 3.
     // After this line the multithreading system is effectively ONLINE!
     // Initialize the PIT timer
+    clock_init(TIMER_FREQUENCY);
     init_timer(TIMER_FREQUENCY);
-    sys_base->k_reenter=-1;
+    // Start the other processors, they wait for the kernel lock
+    smp_init(TIMER_FREQUENCY);
     test = (except_t *) kmalloc(sizeof(except_t));
     if(!(keyboard_thread = create_thread(demo_thread, NULL, NULL,
-                        ((uint32_t *) kmalloc(4000)) + 1000,
+                        (uint32_t *) vm_stack_alloc(),
                         ((uint32_t *) kmalloc(4000)) + 1000,
                     "keyboard.device", 0, 15)))
         panic("can't create new thread");
@@ -169,9 +186,18 @@ void init(multiboot_t * boot_info) {
     test->thread_ptr = keyboard_thread;
     enqueue((list_head_t *) &sys_base->intr_list,
             (list_node_t *) test);*/
+    boot_phase("threads");
+    // Leave the kernel: the other processors may enter it from now on
+    this_cpu()->k_reenter=-1;
+    smp_unlock();
     enter_user_mode();
     permit();
     kprintf("KRYPTON Operating System and Libraries\nRevision 1, built %s\n (C) The ERA Software Team\n\n", __DATE__);
+    boot_report();
+    lock_report();
+    syscall_bench();
+    syscall_report();
+    msg_report();
     // This is the end of the road
     for(;;);
     // wait(0);
@@ -181,7 +207,7 @@ void init(multiboot_t * boot_info) {
 
 int demo_thread(void* niente)
 {
-    kprintf("Hello World from %s!\n", sys_base->running_thread->node.name);
+    kprintf("Hello World from %s!\n", this_cpu()->running_thread->node.name);
     message_t * msg;
     int * scancode;
 
@@ -198,7 +224,8 @@ void protection_fault(registers_t *regs) {
     uint32_t cr2;
     asm volatile ("mov %%cr2, %0" : "=r" (cr2));
 
-    kprintf("OOPS: %s crashed at 0x%x!!\n", sys_base->running_thread->node.name, regs->eip);
+    kprintf("OOPS: %s crashed at 0x%x!!\n", this_cpu()->running_thread->node.name ?
+            this_cpu()->running_thread->node.name : "(unnamed)", regs->eip);
     kprintf("CS: 0x%4X EIP: 0x%8X EFLAGS: 0x%8X\n", regs->cs, regs->eip, regs->eflags);
     kprintf("EAX: 0x%8X EBX: 0x%8X ECX: 0x%8X EDX: 0x%8X\n", regs->eax, regs->ebx, regs->ecx, regs->edx);
     kprintf("ESI: 0x%8X EDI: 0x%8X EBP: 0x%8X ESP: 0x%8X\n", regs->esi, regs->edi, regs->ebp, regs->esp);
@@ -207,25 +234,15 @@ void protection_fault(registers_t *regs) {
 }
 
 void keypress(registers_t *regs) {
-    thread_t * keyboard_driver_thread = find_thread("keyboard.device");
+    // The driver thread is looked up once, then kept as a handle
+    static thread_t * keyboard_driver_thread = NULL;
     int scancode;
 
-    if(!keyboard_driver_thread)
+    if(!keyboard_driver_thread &&
+       !(keyboard_driver_thread = find_thread("keyboard.device")))
         panic("not syncing - no user-mode keyboard driver installed");
 
     scancode = inb(0x60);
     if (!(scancode&0x80))
-        _msg_post(keyboard_driver_thread, &scancode, sizeof(int));
-}
-
-void syscall(registers_t *regs) {
-    if(sys_base->running_thread->uid != 0)
-        return;
-
-    switch(regs->eax) {
-        case 0x00: _wait_for_flags((uint32_t) regs->ebx); break;
-        case 0x01: _monitor_write((char*) regs->ebx); break;
-        case 0x02: _msg_retrieve((message_t**) regs->ebx); break;
-        case 0x03: _msg_cycle(); break;
-    }
+        _msg_try_post(keyboard_driver_thread, (uint8_t *) &scancode, sizeof(int));
 }
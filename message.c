@@ -2,28 +2,96 @@
 
 #include "message.h"
 #include "sysbase.h"
+#include "smp.h"
+#include "deadline.h"
+#include "syscall.h"
+#include "ring.h"
+#include "kprintf.h"
+#include "panic.h"
+
+void init_msg_port(msg_port_t * port) {
+	port->slots = (message_t *) kmalloc(MAX_MESSAGES * sizeof(message_t));
+	if(!port->slots)
+		panic("Out of memory creating a message port.\n");
+	port->head = 0;
+	port->num_msg = 0;
+	port->high_water = 0;
+	port->drops = 0;
+	spin_init(&port->lock, NULL);
+}
 
-void _msg_post(thread_t * thread, uint8_t * src_msg_buf, uint16_t buf_sz) {
+/* Copies a message into the next free slot of the port. Safe from an
+   interrupt handler, as it never touches the heap. On a full port the
+   message is counted as dropped if drop is set, otherwise the caller
+   waits */
+static int msg_put(thread_t * thread, uint8_t * src_msg_buf, uint16_t buf_sz, int drop) {
+	msg_port_t * port = &thread->msg_port;
 	message_t * msg;
+	uint32_t flags;
 
 	// Check bounds
 	if(buf_sz > MAX_MSG_SZ)
-		return 2;
-
-	// Check for a full port
-	if(thread->msg_port.num_msg >= MAX_MESSAGES)
-	{
-		// block_thread(...);
+		return MSG_TOO_BIG;
+
+	flags = spin_lock_irqsave(&port->lock);
+	if(port->num_msg >= MAX_MESSAGES) {
+		if(drop)
+			port->drops++;
+		spin_unlock_irqrestore(&port->lock, flags);
+		return MSG_PORT_FULL;
 	}
-
-	msg = (message_t *) kmalloc(sizeof(message_t));
-	if(!msg)
-		panic("Out of memory posting a message.\n");
-
+	msg = &port->slots[(port->head + port->num_msg) % MAX_MESSAGES];
 	memcpy(msg->msg_buf, src_msg_buf, buf_sz);
-	add_tail((list_head_t *) &thread->msg_port.message_list, (list_node_t *) msg);
-	thread->msg_port.num_msg++;
+	msg->size = buf_sz;
+	if(++port->num_msg > port->high_water)
+		port->high_water = port->num_msg;
+	spin_unlock_irqrestore(&port->lock, flags);
 	_signal(thread, ST_MESG);
+	return MSG_OK;
+}
+
+/* Posts a message, or drops it (and counts the drop) if the port is full.
+   The interrupt handlers post this way */
+int _msg_try_post(thread_t * thread, uint8_t * src_msg_buf, uint16_t buf_sz) {
+	return msg_put(thread, src_msg_buf, buf_sz, 1);
+}
+
+/* Posts a message from a system call. If the port is full, the running
+   thread is queued in the msg_wait_proc of the receiver until
+   _msg_cycle() frees a slot, and MSG_WAIT tells the wrapper to post
+   again then. A thread posting to itself cannot wait for itself, its
+   message is dropped */
+int _msg_post(thread_t * thread, uint8_t * src_msg_buf, uint16_t buf_sz) {
+	thread_t * sender = this_cpu()->running_thread;
+	int ret = msg_put(thread, src_msg_buf, buf_sz, thread == sender);
+
+	if(ret != MSG_PORT_FULL || thread == sender)
+		return ret;
+	add_tail((list_head_t *) &thread->msg_wait_proc, &sender->post_node);
+	_wait_for_flags(ST_PORT);
+	return MSG_WAIT;
+}
+
+/* System call wrapper posting a message, waiting while the port is full.
+   Returns MSG_OK, MSG_TOO_BIG, or MSG_PORT_FULL for a thread posting to
+   its own full port */
+int msg_post(thread_t * thread, void * src_msg_buf, uint16_t buf_sz)
+{
+	int ret;
+
+	do {
+		ret = (int) do_syscall(SYS_MSG_POST, (uint32_t) thread,
+		                       (uint32_t) src_msg_buf, buf_sz);
+	} while(ret == MSG_WAIT);
+	return ret;
+}
+
+/* System call wrapper posting a message without waiting.
+   Returns MSG_OK, MSG_PORT_FULL (the message was dropped) or MSG_TOO_BIG */
+int msg_try_post(thread_t * thread, void * src_msg_buf, uint16_t buf_sz)
+{
+	return (int) do_syscall(SYS_MSG_TRY_POST, (uint32_t) thread,
+	                        (uint32_t) src_msg_buf, buf_sz);
 }
 
 /* System call wrapper with struct-based return. */
@@ -32,9 +100,7 @@ message_t * msg_retrieve()
 	message_t * volatile return_message = NULL;
 
     do {
-    	asm volatile("mov $2, %%eax; \
-                  mov %0, %%ebx; \
-                  int $0xFF;" :: "r" (&return_message) : "%eax", "%ebx");
+    	do_syscall(SYS_MSG_RETRIEVE, (uint32_t) &return_message, 0, 0);
     	if(!return_message)
     		wait(ST_MESG);
     	else
@@ -47,22 +113,52 @@ message_t * msg_retrieve()
 /* System call wrapper with no argument. */
 void msg_cycle()
 {
-    asm volatile("mov $3, %%eax; \
-                  int $0xFF;" ::: "%eax");
+    do_syscall(SYS_MSG_CYCLE, 0, 0, 0);
 
 }
 
 void _msg_retrieve(message_t ** msg_ptr) {
-	*msg_ptr = (message_t *) get_head((list_head_t*)&sys_base->running_thread->msg_port.message_list);
+	msg_port_t * port = &this_cpu()->running_thread->msg_port;
+	uint32_t flags = spin_lock_irqsave(&port->lock);
+
+	*msg_ptr = port->num_msg ? &port->slots[port->head] : NULL;
+	spin_unlock_irqrestore(&port->lock, flags);
 }
 
+/* Frees the slot of the oldest message, for the next post. The first
+   sender waiting for a slot is woken to post again */
 void _msg_cycle()
 {
-	message_t * msg = remove_head((list_head_t*)&sys_base->running_thread->msg_port.message_list);
+	thread_t * thread = this_cpu()->running_thread, * sender;
+	msg_port_t * port = &thread->msg_port;
+	uint32_t flags = spin_lock_irqsave(&port->lock);
+	list_node_t * node;
 
-	if(!msg)
+	if(!port->num_msg) {
+		spin_unlock_irqrestore(&port->lock, flags);
 		return;
-	kfree(msg);
+	}
+	port->head = (port->head + 1) % MAX_MESSAGES;
+	port->num_msg--;
+	spin_unlock_irqrestore(&port->lock, flags);
+
+	if(!(node = remove_head((list_head_t *) &thread->msg_wait_proc)))
+		return;
+	sender = (thread_t *) ((uint8_t *) node - offsetof(thread_t, post_node));
+	_signal(sender, ST_PORT);
+}
+
+void msg_report()
+{
+	list_node_t * node;
+	msg_port_t * port;
+
+	kprintf("Message ports (queued/high water/drops):\n");
+	for(node = get_head((list_head_t *) &sys_base->msgport_list); node; node = get_next(node)) {
+		port = (msg_port_t *) node;
+		kprintf("  %s: %u/%u/%u\n", node->name ? node->name : "(unnamed)",
+		        port->num_msg, port->high_water, port->drops);
+	}
 }
 
 int _signal(thread_t * thread, int sig_flags) {
@@ -70,14 +166,26 @@ int _signal(thread_t * thread, int sig_flags) {
 		return -1;
 
 	thread->sig_recvd |= sig_flags;
-	thread->sig_wait &= (~sig_flags);
+	// A batched wait completes with the signals that ended it
+	ring_wake(thread, thread->sig_wait & sig_flags);
+	/* The thread stops waiting for the other signals too,
+	   and for its timeout */
+	thread->sig_wait = 0;
+	timer_cancel(&thread->timer);
 
 	remove((list_node_t*) thread);
-    enqueue((list_head_t*) &sys_base->thread_ready,
-            (list_node_t*) thread);
+    /* The thread goes back to the CPU it ran on, unless its affinity
+       changed meanwhile. That CPU may have to be interrupted to look at it */
+    if(!(thread->affinity & (1 << thread->cpu))) {
+        thread->cpu = smp_least_loaded(thread->affinity)->id;
+        cpus[thread->cpu].migrations++;
+    }
+    if(thread->dl.runtime)
+        dl_wakeup(thread);
+    rq_add(&cpus[thread->cpu].thread_ready, thread);
     thread->thread_flags &= (~TS_WAIT);
     thread->thread_flags |= TS_READY;
-    sys_base->sys_flags |= NEED_SCHEDULE;
+    smp_reschedule(&cpus[thread->cpu]);
 
     return 0;
 }
\ No newline at end of file
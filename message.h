@@ -12,15 +12,33 @@
 
 #define MF_UNREAD 1
 
+/* Results of _msg_post() and _msg_try_post() */
+#define MSG_OK 0
+#define MSG_PORT_FULL 1
+#define MSG_TOO_BIG 2
+#define MSG_WAIT 3	// The sender was queued on the full port, to post again once woken
+
 struct message_s {
-	list_node_t node;
+	uint32_t size;
 	uint8_t msg_buf[MAX_MSG_SZ];
 };
 
 typedef struct message_s message_t;
 
-/* Post a message (non-blocking) on a port */
-void _msg_post(thread_t *, uint8_t * src_msg_buf, uint16_t buf_sz);
+/* Allocate the message slots of a new port */
+void init_msg_port(msg_port_t * port);
+
+/* Post a message on a port, waiting for a free slot from user space */
+int msg_post(thread_t * thread, void * src_msg_buf, uint16_t buf_sz);
+
+/* Post a message on a port, dropping it if the port is full */
+int msg_try_post(thread_t * thread, void * src_msg_buf, uint16_t buf_sz);
+
+/* Post a message, queuing the running thread on a full port */
+int _msg_post(thread_t *, uint8_t * src_msg_buf, uint16_t buf_sz);
+
+/* Post a message (non-blocking) on a port, from anywhere */
+int _msg_try_post(thread_t *, uint8_t * src_msg_buf, uint16_t buf_sz);
 
 /* Retrieve a message form the thread's local port */
 void _msg_retrieve(message_t ** );
@@ -28,4 +46,10 @@ void _msg_retrieve(message_t ** );
 /* Delete a retrieved (or not) message */
 void _msg_cycle();
 
+/* Wake a thread waiting for any of the given signals */
+int _signal(thread_t * thread, int sig_flags);
+
+/* Print the high-water marks and drops of the message ports */
+void msg_report();
+
 #endif /* MESSAGE_H */
\ No newline at end of file
@@ -6,6 +6,7 @@
 #include "pmm.h"
 #include "common.h"
 #include "sysbase.h"
+#include "syscall.h"
 
 uint16_t *video_memory = (uint16_t*) 0xB8000;
 
@@ -58,9 +59,7 @@ static void scroll() {
 
 void monitor_write(char *c)
 {
-    asm volatile("mov $1, %%eax; \
-                  mov %0, %%ebx; \
-                  int $0xFF;" :: "r" (c) : "%eax", "%ebx");
+    do_syscall(SYS_WRITE, (uint32_t) c, 0, 0);
 }
 
 void monitor_put(char c) {
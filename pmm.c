@@ -12,12 +12,32 @@
 #include "panic.h"
 #include "kprintf.h"
 #include "idt.h"
+#include "slab.h"
+#include "vmm.h"
+#include "timer.h"
  
-#define SH_HEAP_START       (unsigned long)     0xC0400000
+#define PHYS_MAP_START      (unsigned long)     0xD0000000
+#define PHYS_MAP_SIZE       (unsigned long)     0x10000000
 #define PM_DIR_CLONE_ADDR   (unsigned long *)   0xFE000000
 #define PM_PAGE_CLONE_ADDR  (unsigned long *)   0xFE800000
-#define PM_STACK_ADDR       (unsigned long *)   0xFF000000
+#define PM_FRAMES_ADDR      (unsigned long)     0xF0000000
+#ifdef CONFIG_PAE
+#define MAX_RAM_PAGES       (unsigned long)     0x01000000 // 64GiB
+#define PT_WINDOW           (pte_t *)           0xFF800000
+#define PD_WINDOW           (pte_t *)           0xFFFFC000
+#else
 #define MAX_RAM_PAGES       (unsigned long)     0x000A0000
+#define PT_WINDOW           (pte_t *)           0xFFC00000
+#define PD_WINDOW           (pte_t *)           0xFFFFF000
+#endif
+#define PTE_ADDR_MASK       (~(phys_addr_t) 0xFFF)
+/* Page table entry and page directory entry mapping an address,
+ * reached through the self-referencing page directory */
+#define PTE_OF(v)           (PT_WINDOW + ((unsigned long) (v) >> 12))
+#define PDE_OF(v)           (PD_WINDOW + ((unsigned long) (v) >> PT_SHIFT))
+#define PM_LOW_RESERVED     (unsigned long)     0x00020000
+#define PM_KERNEL_START     (unsigned long)     0x00100000
+#define PM_CARVE_WATERMARK  16 // Free frames kept to carve the next chunk
 
 /***************************************
  * Static Function Prototypes
@@ -26,23 +46,58 @@ static void split_chunk(heap_header_t *chunk, uint32_t len);
 
 static void alloc_chunk(uint32_t start, uint32_t len);
 
-static void glue_chunk (heap_header_t *chunk);
-
 static void free_chunk (heap_header_t *chunk);
 
+static heap_header_t *find_chunk(uint32_t len);
+
+static void bin_insert(heap_header_t *chunk);
+
+static void bin_remove(heap_header_t *chunk);
+
+static inline void set_chunk(heap_header_t *chunk, uint32_t len, uint32_t allocated);
+
+static void pm_add_range(uint32_t first, uint32_t last);
+
+static pte_t * get_pagetable(unsigned long virtualaddr, unsigned int flags);
+
+static void frame_push(uint32_t frame, uint32_t order);
+
+static void frame_unlink(uint32_t frame);
+
+static void buddy_free(phys_addr_t page, unsigned int order);
+
 static inline void flush_tlb(unsigned long virtualaddr);
 
 static void page_fault(registers_t *regs);
 
+static pm_frame_t * pm_frame_of(phys_addr_t page);
+
+static int cow_fault(unsigned long virtualaddr);
+
 /***************************************
  * Globals
  ***************************************/
-/* x86-compatible Page Directory container */
-unsigned long kernelpagedir[1024] __attribute__((aligned(4096)));
-/* x86-compatible 0-4MiB Page Table container */
-unsigned long lowpagetable[1024] __attribute__((aligned(4096)));
-/* Pointer to the page directory phisical address */
+#ifdef CONFIG_PAE
+/* PAE Page Directory Pointer Table, the one CR3 points to */
+uint64_t kernelpdpt[4] __attribute__((aligned(32)));
+#endif
+/* x86-compatible Page Directory container (four of them with PAE) */
+pte_t kernelpagedir[PD_ENTRIES] __attribute__((aligned(4096)));
+/* x86-compatible 0-4MiB Page Table container (two of them with PAE),
+   for the boot identity map */
+pte_t lowpagetable[1024] __attribute__((aligned(4096)));
+/* Same for the kernel image at 3072MB, kept apart as its entries are global */
+pte_t kernelpagetable[1024] __attribute__((aligned(4096)));
+/* Pointer to the page directory phisical address (the PDPT with PAE) */
 void *kernelpagedirPtr = 0;
+/* PAGE_GLOBAL if the processor supports global pages, 0 otherwise */
+unsigned long page_global = 0;
+/* Set if the processor supports large pages (PSE) */
+unsigned long page_large = 0;
+/* Set while pm_carve() runs, so it is never reentered */
+static int pm_carving = 0;
+/* Number of CR3 reloads done by the dispatcher */
+uint32_t cr3_reloads = 0;
 /* Last kernel page physical address */
 uint32_t kernel_seg_end_page;
 /* flag to tell if the virtual memory system is initialized */
@@ -63,40 +118,94 @@ extern unsigned int end;
 void init_paging() {
     // Pointers to the page directory and the page table
 
+    void *kernelpagedirPhys = 0;
     void *lowpagetablePtr = 0;
-    int k = 0;
+    void *kernelpagetablePtr = 0;
+    unsigned long cr4 = 0;
+    pte_t entry;
+    unsigned int k = 0;
 
     // Translate the page directory from
     // virtual address to physical address
-    kernelpagedirPtr = (char *) kernelpagedir + 0x40000000;
+    kernelpagedirPhys = (void *) ((unsigned long) kernelpagedir + 0x40000000);
     // Same for the page table
-    lowpagetablePtr = (char *) lowpagetable + 0x40000000;
+    lowpagetablePtr = (void *) ((unsigned long) lowpagetable + 0x40000000);
+    kernelpagetablePtr = (void *) ((unsigned long) kernelpagetable + 0x40000000);
+
+    // The kernel mappings are made global if the processor can do it,
+    // and mapped with large pages if it supports PSE
+    if (cpuid_features() & CPUID_PGE)
+        page_global = PAGE_GLOBAL;
+    if (cpuid_features() & CPUID_PSE) {
+        page_large = 1;
+        cr4 |= 0x10;
+    }
 
     // Counts from 0 to 1023 to...
     for (k = 0; k < 1024; k++) {
-        // ...map the first 4MB of memory into the page table...
+        // ...map the first 4MB of memory into the page tables. Only the
+        // kernel half is global, the identity map is in the user half and
+        // must go away with the address space...
         lowpagetable[k] = (k * 4096) | 0x7;
-        // ...and clear the page directory entries
-        kernelpagedir[k] = 0;
+        kernelpagetable[k] = (k * 4096) | 0x7 | page_global;
     }
+    // ...and clear the page directory entries
+    for (k = 0; k < PD_ENTRIES; k++)
+        kernelpagedir[k] = 0;
 
     // Fills the addresses 0...4MB and 3072MB...3076MB
-    // of the page directory with the same page table
-
-    kernelpagedir[0] = ((unsigned long) lowpagetablePtr) | 0x7;
-    kernelpagedir[768] = ((unsigned long) lowpagetablePtr) | 0x7;
+    // of the page directory with their page table(s),
+    // or straight with large pages
+    for (k = 0; k < (0x400000 >> PT_SHIFT); k++) {
+        if (page_large) {
+            entry = ((pte_t) k << PT_SHIFT) | PAGE_LARGE | 0x7;
+            kernelpagedir[k] = entry;
+            kernelpagedir[(KERNEL_VIRTUAL_BASE >> PT_SHIFT) + k] = entry | page_global;
+        } else {
+            kernelpagedir[k] = ((unsigned long) lowpagetablePtr + k * 4096) | 0x7;
+            kernelpagedir[(KERNEL_VIRTUAL_BASE >> PT_SHIFT) + k] =
+                    ((unsigned long) kernelpagetablePtr + k * 4096) | 0x7;
+        }
+    }
 
     // Self-reference the page directory for later easy access
-    kernelpagedir[1023] = ((unsigned long) kernelpagedirPtr) | 0x3;
+    for (k = 0; k < PD_PAGES; k++)
+        kernelpagedir[((unsigned long) PT_WINDOW >> PT_SHIFT) + k] =
+                ((unsigned long) kernelpagedirPhys + k * 4096) | 0x3;
+
+#ifdef CONFIG_PAE
+    // Point the PDPT to the four page directories
+    // (only the present bit may be set in its entries)
+    for (k = 0; k < 4; k++)
+        kernelpdpt[k] = ((unsigned long) kernelpagedirPhys + k * 4096) | 0x1;
+    kernelpagedirPtr = (void *) ((unsigned long) kernelpdpt + 0x40000000);
+    cr4 |= 0x20;
+#else
+    kernelpagedirPtr = kernelpagedirPhys;
+#endif
+
+    // PAE and PSE must be enabled in CR4 before paging is
+    if (cr4)
+        asm volatile ( "mov %%cr4, %%eax\n"
+                "orl %0, %%eax\n"
+                "mov %%eax, %%cr4\n" :: "r" (cr4) : "%eax");
 
     // Copies the address of the page directory into the CR3 register and,
-    // finally, enables paging!
+    // finally, enables paging! Write protection is enforced for the kernel
+    // too (CR0.WP), so it can't write through a copy-on-write page.
 
     asm volatile ( "mov %0, %%eax\n"
             "mov %%eax, %%cr3\n"
             "mov %%cr0, %%eax\n"
-            "orl $0x80000000, %%eax\n"
+            "orl $0x80010000, %%eax\n"
             "mov %%eax, %%cr0\n" ::"m" (kernelpagedirPtr));
+
+    // Enable global pages, so the kernel's TLB entries survive
+    // the CR3 reloads done on thread switches
+    if (page_global)
+        asm volatile ( "mov %%cr4, %%eax\n"
+                "orl $0x80, %%eax\n"
+                "mov %%eax, %%cr4\n" ::: "%eax");
 }
 
 void switch_page_directory(void *pagetabledir_ptr) {
@@ -114,231 +223,474 @@ void switch_page_directory(void *pagetabledir_ptr) {
 void mm_init(multiboot_t *mboot_ptr) {
     // Unwind our starting placement address from the very end of the kernel
     unsigned int start = ((unsigned int) & end + 0x40000000);
-    unsigned long *mm_stack; // Memory Manager stack pointer
-    // initialize the 4kB pages counter
-    uint32_t ram_pages = 0;
+    unsigned long long base, region_end;
+    unsigned long v;
+    uint32_t i, j, order;
+    pm_region_t region;
+    boot_phase("start");
     // initialize paging, get rid of segmentation and initialize interrupts
     init_paging();
-    gdt_install();
+    gdt_install(&cpus[0]);
     init_idt();
 
     // Register the page-fault handler (Exp. 14 on x86)
     register_interrupt_handler(14, &page_fault);
     kernel_seg_end_page = (start + 0x100000) & PAGE_MASK;
-    start = (mboot_ptr->mem_upper) * 1024;
 
     sys_base = &SystemBaseStruct;
-    // Set the last page to be allocated
-    sys_base->pm_last_page = (start + 0x1000) & PAGE_MASK;
+    // The locks of the kernel and of its allocators
+    spin_init(&sys_base->kernel_lock, "kernel");
+    spin_init(&sys_base->pm_lock, "frames");
+    spin_init(&sys_base->heap_lock, "heap");
+    // Boot-time pages are handed out right after the kernel segment
+    sys_base->pm_last_page = kernel_seg_end_page - 0x1000;
     sys_base->vm_online = 0;
-    // Setup the physical memory stack
-    mm_stack = (unsigned long *) mm_map((void*) pm_alloc(),
-            PM_STACK_ADDR, PAGE_WRITE);
-
-    sys_base->mm_free_page_stack_ptr = mm_stack;
-    sys_base->mm_free_page_stack_max = (uint32_t) mm_stack;
-
-    // Now let's fill the page allocator stack
-    // For each entry in the memory info passed by GRUB, "free" those pages
-
     sys_base->free_pages = 0;
-
-    uint32_t i = mboot_ptr->mmap_addr;
-    while (i < mboot_ptr->mmap_addr + mboot_ptr->mmap_length) {
+    boot_phase("paging");
+
+    // Record the usable RAM as a sorted list of frame regions.
+    // The frames themselves are only handed to the buddy allocator later,
+    // 4MiB at a time, by pm_carve().
+    // The multiboot specification is strange in this respect - the size member does not include "size" itself in its calculations,
+    // so we must add sizeof (uint32_t).
+    sys_base->pm_num_regions = 0;
+    sys_base->pm_max_frame = 0;
+    for (i = mboot_ptr->mmap_addr;
+         i < mboot_ptr->mmap_addr + mboot_ptr->mmap_length;
+         i += ((mmap_entry_t*) i)->size + sizeof (uint32_t)) {
         mmap_entry_t *me = (mmap_entry_t*) i;
 
-        // Does this entry specify usable RAM?
-        if (me->type == 1) {
-            uint32_t j;
-            // For every page in this entry, add to the free page stack.
-            for (j = me->base_addr_low; j < me->base_addr_low + me->length_low; j += 0x1000) {
-                if(++ram_pages >= MAX_RAM_PAGES)
-                    continue; /* 'continue' here will cause the
-                               * pages not to be added */
-                pm_free(j);
-            }
-        }
-
-        // The multiboot specification is strange in this respect - the size member does not include "size" itself in its calculations,
-        // so we must add sizeof (uint32_t).
-        i += me->size + sizeof (uint32_t);
+        // Does this entry specify usable RAM we can address?
+        base = ((unsigned long long) me->base_addr_high << 32) | me->base_addr_low;
+        region_end = base +
+                (((unsigned long long) me->length_high << 32) | me->length_low);
+        if (me->type != 1 || (base >> 12) >= MAX_RAM_PAGES ||
+            sys_base->pm_num_regions == PM_MAX_REGIONS)
+            continue;
+        region.first = (uint32_t) ((base + 0xFFF) >> 12);
+        region.last = (region_end >> 12) > MAX_RAM_PAGES ?
+                MAX_RAM_PAGES : (uint32_t) (region_end >> 12);
+        if (region.first >= region.last)
+            continue;
+        // Insert it in address order
+        for (j = sys_base->pm_num_regions;
+             j > 0 && sys_base->pm_regions[j - 1].first > region.first; j--)
+            sys_base->pm_regions[j] = sys_base->pm_regions[j - 1];
+        sys_base->pm_regions[j] = region;
+        sys_base->pm_num_regions++;
+        if (region.last > sys_base->pm_max_frame)
+            sys_base->pm_max_frame = region.last;
+    }
+    sys_base->pm_num_chunks = (sys_base->pm_max_frame + (1 << PM_MAX_ORDER) - 1) >> PM_MAX_ORDER;
+    sys_base->pm_next_chunk = 0;
+
+    // The frame descriptors are mapped chunk by chunk, but their page
+    // tables must exist beforehand, so carving needs as few pages as possible
+    sys_base->pm_frames = (pm_frame_t *) PM_FRAMES_ADDR;
+    for (v = PM_FRAMES_ADDR;
+         v < PM_FRAMES_ADDR + sys_base->pm_num_chunks * PM_CHUNK_DESC_SIZE;
+         v += LARGE_PAGE_SIZE)
+        get_pagetable(v, PAGE_WRITE);
+    for (order = 0; order <= PM_MAX_ORDER; order++) {
+        sys_base->pm_free_area[order].head = PM_NO_FRAME;
+        sys_base->pm_free_area[order].count = 0;
     }
 
+    // Carve the first chunk now, using boot-time pages for its descriptors.
+    // The rest will follow on demand
+    pm_carve();
     // Tell the physical allocator that virtual memory is ONLINE!
     sys_base->vm_online = 1;
+    boot_phase("frames");
+
+    // Map the low physical memory linearly, with large pages
+    base = 0;
+    if (page_large)
+        for (; base < PHYS_MAP_SIZE &&
+               base < ((unsigned long long) sys_base->pm_max_frame << 12);
+             base += LARGE_PAGE_SIZE)
+            mm_map_large(base, (void*) (PHYS_MAP_START + (unsigned long) base),
+                    PAGE_WRITE);
+    sys_base->phys_map_end = base;
 
     // Now we will initialize the shared memory heap
-    // Fill in the list header fields with an empty list
-    sys_base->sh_heap = NULL;
+    // Empty all the free chunk bins
+    memset((uint8_t *) sys_base->sh_heap_bins, 0, sizeof (sys_base->sh_heap_bins));
+    sys_base->sh_heap_bin_map = 0;
     // Make the maximum heap address to be the start i.e. the heap is empty
+    sys_base->sh_heap_top = SH_HEAP_START;
     sys_base->sh_heap_max = SH_HEAP_START;
+    // Small allocations are served by the slab size classes
+    slab_init();
+    vm_init();
+    boot_phase("heap");
 }
 
 /* kmalloc() - kernel memory allocation funtion
  *
- * This function allocates l bytes in the kernel heap
+ * This function allocates l bytes in the kernel heap.
+ * Small requests are served in O(1) by the slab size classes,
+ * the others take the best fit from the segregated free bins.
  */
 
 void *kmalloc(uint32_t l) {
-    l += sizeof (heap_header_t);
-    heap_header_t *cur_header = sys_base->sh_heap, *prev_header = 0;
-    // Try to find a chunk best-fit to begin with
-    while (cur_header) {
-        if (cur_header->allocated == 0 && cur_header->length >= l) {
-            // If we find a fitting chunk, spit it...
-            split_chunk(cur_header, l);
-            // ... set it to be allocated ...
-            cur_header->allocated = 1;
-            // ... and return the address of the new block (NOT THE HEADER!!)
-            return (void*) ((uint32_t) cur_header + sizeof (heap_header_t));
+    heap_header_t *chunk;
+    heap_footer_t *last;
+    uint32_t flags;
+
+    if (l <= SLAB_MAX_SIZE)
+        return slab_alloc(l);
+
+    // Make room for the boundary tags and keep the chunks 4-byte aligned
+    l = (l + sizeof (heap_header_t) + sizeof (heap_footer_t) + 3) & ~3;
+
+    flags = spin_lock_irqsave(&sys_base->heap_lock);
+
+    if ((chunk = find_chunk(l))) {
+        // If we find a fitting chunk, take it out of its bin and split it
+        bin_remove(chunk);
+        split_chunk(chunk, l);
+    } else {
+        // If we come here, no fitting chunk was found, so grow the heap.
+        // If the last chunk is free, extend it instead of leaving a hole
+        chunk = (heap_header_t *) sys_base->sh_heap_top;
+        last = (heap_footer_t *) (sys_base->sh_heap_top - sizeof (heap_footer_t));
+        if (sys_base->sh_heap_top > SH_HEAP_START && last->allocated == 0) {
+            chunk = (heap_header_t *) ((uint32_t) chunk - last->length);
+            bin_remove(chunk);
         }
-        prev_header = cur_header;
-        cur_header = cur_header->next;
-    }
-    // If we come here, no fitting chunk was found
-    uint32_t chunk_start;
-    if (prev_header)
-        // So either we need a new chunk
-        chunk_start = (uint32_t) prev_header + prev_header->length;
-    else {
-        // Or it is the first time we're allocating
-        chunk_start = SH_HEAP_START;
-        sys_base->sh_heap = (heap_header_t *)chunk_start;
+        alloc_chunk((uint32_t) chunk, l);
+        sys_base->sh_heap_top = (uint32_t) chunk + l;
+        set_chunk(chunk, l, 0);
     }
-    // Either way, allocate a new chunk
-    alloc_chunk(chunk_start, l);
-    // Set it's attributes accordingly
-    cur_header = (heap_header_t *) chunk_start;
-    cur_header->prev = prev_header;
-    cur_header->next = 0;
-    cur_header->allocated = 1;
-    cur_header->length = l;
-    // Link it to the next chunk (or NULL if it's the last) ...
-    prev_header->next = cur_header;
+    set_chunk(chunk, chunk->length, 1);
+    spin_unlock_irqrestore(&sys_base->heap_lock, flags);
     // ... and return the address of the new block (NOT THE HEADER!!)
-    return (void*) (chunk_start + sizeof (heap_header_t));
+    return (void*) ((uint32_t) chunk + sizeof (heap_header_t));
 }
 
-/* kmalloc(p) - kernel memory allocation funtion
+/* kfree(p) - kernel memory deallocation funtion
  *
- * This function frees the block p allocated in the kernel heap
+ * This function frees the block p allocated in the kernel heap,
+ * merging it with its free neighbours in constant time
  */
 void kfree (void *p)
 {
-  heap_header_t *header = (heap_header_t*)((uint32_t)p - sizeof(heap_header_t));
-  // Just set the 'allocated' flag to 0
-  header->allocated = 0;
-  // Run glue_chunk to unify the block if needed
-  glue_chunk (header);
+  if (SLAB_OWNS(p)) {
+    slab_free(p);
+    return;
+  }
+
+  heap_header_t *chunk = (heap_header_t*)((uint32_t)p - sizeof(heap_header_t));
+  heap_header_t *next = (heap_header_t*)((uint32_t)chunk + chunk->length);
+  heap_footer_t *prev = (heap_footer_t*)((uint32_t)chunk - sizeof(heap_footer_t));
+  uint32_t len = chunk->length;
+  uint32_t flags = spin_lock_irqsave(&sys_base->heap_lock);
+
+  // Glue the following chunk, if it is free...
+  if ((uint32_t)next < sys_base->sh_heap_top && next->allocated == 0)
+  {
+    bin_remove (next);
+    len += next->length;
+  }
+  // ... and the preceding one, found through its footer
+  if ((uint32_t)chunk > SH_HEAP_START && prev->allocated == 0)
+  {
+    chunk = (heap_header_t*)((uint32_t)chunk - prev->length);
+    bin_remove (chunk);
+    len += chunk->length;
+  }
+  set_chunk (chunk, len, 0);
+
+  // The last chunk gives its pages back, the others go to a bin
+  if ((uint32_t)chunk + len == sys_base->sh_heap_top)
+    free_chunk (chunk);
+  else
+    bin_insert (chunk);
+  spin_unlock_irqrestore(&sys_base->heap_lock, flags);
 }
 
 
-void * get_physaddr(void * virtualaddr) {
-    unsigned long pdindex = (unsigned long) virtualaddr >> 22;
-    unsigned long ptindex = (unsigned long) virtualaddr >> 12 & 0x03FF;
+phys_addr_t get_physaddr(void * virtualaddr) {
+    pte_t * pde = PDE_OF(virtualaddr);
+    pte_t * pte = PTE_OF(virtualaddr);
 
-    unsigned long * pd = (unsigned long *) 0xFFFFF000;
     // Here you need to check whether the PD entry is present.
     // If the page table isn't present, return null
-    if ((pd[pdindex] & 0x01) == 0)
-        return NULL;
+    if ((*pde & 0x01) == 0)
+        return 0;
+
+    // A large page maps the whole range of the directory entry
+    if (*pde & PAGE_LARGE)
+        return (*pde & ~(phys_addr_t) (LARGE_PAGE_SIZE - 1)) +
+                ((unsigned long) virtualaddr & (LARGE_PAGE_SIZE - 1));
 
-    unsigned long * pt = ((unsigned long *) 0xFFC00000) + (0x400 * pdindex);
     // Here you need to check whether the PT entry is present.
     // If the page isn't present, return null
-    if ((pt[ptindex] & 0x01) == 0)
-        return NULL;
+    if ((*pte & 0x01) == 0)
+        return 0;
 
-    return (void *) ((pt[ptindex] & ~0xFFF) + ((unsigned long) virtualaddr & 0xFFF));
+    return (*pte & PTE_ADDR_MASK) + ((unsigned long) virtualaddr & 0xFFF);
 }
 
-void * mm_map(void * physaddr, void * virtualaddr, unsigned int flags) {
+/* get_pageflags() - PAGE_* flags of the page mapping virtualaddr
+ *
+ * A page is only user accessible, or writable, if its directory entry
+ * is too. Returns 0 if it isn't mapped
+ */
+unsigned int get_pageflags(void * virtualaddr) {
+    pte_t * pde = PDE_OF(virtualaddr);
+    pte_t pte;
 
-    unsigned long pdindex = (unsigned long) virtualaddr >> 22;
-    unsigned long ptindex = ((unsigned long) virtualaddr >> 12) & 0x03FF;
-    unsigned long * pt;
+    if ((*pde & 0x01) == 0)
+        return 0;
+    if (*pde & PAGE_LARGE)
+        return *pde & 0xFFF;
+    pte = *PTE_OF(virtualaddr);
+    if ((pte & 0x01) == 0)
+        return 0;
+    return (pte & 0xFFF) & (*pde | ~(PAGE_USER | PAGE_WRITE));
+}
+
+void * mm_map(phys_addr_t physaddr, void * virtualaddr, unsigned int flags) {
+
+    pte_t * pte = PTE_OF(virtualaddr);
 
     if (physaddr == 0)
         return 0;
 
-    unsigned long * pd = (unsigned long *) 0xFFFFF000;
+    // Only the kernel's higher half is the same in every address space,
+    // except for the self-referencing page tables window
+    flags &= ~PAGE_GLOBAL;
+    get_pagetable((unsigned long) virtualaddr, flags);
+    if ((unsigned long) virtualaddr >= KERNEL_VIRTUAL_BASE &&
+        (unsigned long) virtualaddr < (unsigned long) PT_WINDOW)
+        flags |= page_global;
+    // Here you need to check whether the PT entry is present.
+    // When it is, then there is already a mapping present. What do you do now?
+    *pte = physaddr | (flags & 0xFFF) | 0x01; // Present
+
+    // Now you need to flush the entry in the TLB
+    // to validate the change.
+
+    flush_tlb((unsigned long) virtualaddr);
+
+    return virtualaddr;
+}
+
+/* get_pagetable() - returns the page table mapping virtualaddr
+ *
+ * If the page table isn't present, a new empty one is added
+ */
+static pte_t * get_pagetable(unsigned long virtualaddr, unsigned int flags) {
+    pte_t * pde = PDE_OF(virtualaddr);
+    pte_t * pt = PTE_OF(virtualaddr & ~((1 << PT_SHIFT) - 1));
+
     // Here you need to check whether the PD entry is present.
     // When it is not present, you need to create a new empty PT and
     // adjust the PDE accordingly.
-
-    if ((pd[pdindex] & 0x01) == 0){ // If the page table isn't present, add one
-        pd[pdindex] = pm_alloc() | (flags & 0xFFF) | 0x01;
+    if ((*pde & 0x01) == 0){
+        *pde = pm_alloc() | (flags & 0xFFF) | 0x01;
         // zero out the page table
-        pt = ((unsigned long *) 0xFFC00000) + 0x400 * pdindex;
-        memset(pt, 0, 4096);
+        flush_tlb((unsigned long) pt);
+        memset((uint8_t *) pt, 0, 4096);
     }
+    else if (*pde & PAGE_LARGE)
+        panic("Mapping a page over a large page.\n");
+    return pt;
+}
 
-    pt = ((unsigned long *) 0xFFC00000) + 0x400 * pdindex; // 0x400 ??
-    // Here you need to check whether the PT entry is present.
-    // When it is, then there is already a mapping present. What do you do now?
-    pt[ptindex] = ((unsigned long) physaddr) | (flags & 0xFFF) | 0x01; // Present
+/* mm_map_large() - maps a large page (LARGE_PAGE_SIZE bytes)
+ *
+ * Both addresses must be aligned to the large page size. A page table
+ * at virtualaddr may be shared by other address spaces, so it is never
+ * replaced.
+ */
+void * mm_map_large(phys_addr_t physaddr, void * virtualaddr, unsigned int flags) {
+    pte_t * pde = PDE_OF(virtualaddr);
 
-    // Now you need to flush the entry in the TLB
-    // to validate the change.
+    if ((*pde & 0x01) && !(*pde & PAGE_LARGE))
+        panic("Mapping a large page over a page table.\n");
+    flags &= ~PAGE_GLOBAL;
+    if ((unsigned long) virtualaddr >= KERNEL_VIRTUAL_BASE &&
+        (unsigned long) virtualaddr < (unsigned long) PT_WINDOW)
+        flags |= page_global;
+    *pde = physaddr | (flags & 0xFFF) | PAGE_LARGE | 0x01;
 
     flush_tlb((unsigned long) virtualaddr);
 
     return virtualaddr;
 }
 
+/* mm_map_pagetables() - adds the empty page tables covering [start, end)
+ *
+ * Address spaces share the page tables of the kernel half, so a kernel
+ * range populated after they were cloned must have its tables beforehand.
+ * Large pages already mapped there are left as they are.
+ */
+void mm_map_pagetables(void * start, void * end, unsigned int flags) {
+    unsigned long addr;
+
+    for (addr = (unsigned long) start; addr < (unsigned long) end;
+         addr += 1 << PT_SHIFT)
+        if (!(*PDE_OF(addr) & PAGE_LARGE))
+            get_pagetable(addr, flags & ~PAGE_GLOBAL);
+}
+
+/* phys_to_virt() - address of a frame in the linear physical map
+ *
+ * Returns NULL if the frame is above the linearly mapped memory
+ */
+void * phys_to_virt(phys_addr_t physaddr) {
+    if (physaddr >= sys_base->phys_map_end)
+        return NULL;
+    return (void *) (PHYS_MAP_START + (unsigned long) physaddr);
+}
+
 void mm_unmap(void * virtualaddr) {
 
-    unsigned long pdindex = (unsigned long) virtualaddr >> 22;
-    unsigned long ptindex = ((unsigned long) virtualaddr >> 12) & 0x03FF;
-    unsigned long * pt;
-    
-    pt = ((unsigned long *) 0xFFC00000) + 0x400 * pdindex; // 0x400 ??
-    // Set the page table entry to 0
-    pt[ptindex] = 0;
+    pte_t * pde = PDE_OF(virtualaddr);
 
-    // Now you need to flush the entry in the TLB
-    // to validate the change.
+    // A large page goes away as a whole,
+    // otherwise set the page table entry to 0
+    if (*pde & PAGE_LARGE)
+        *pde = 0;
+    else
+        *PTE_OF(virtualaddr) = 0;
 
+    // Now you need to flush the entry in the TLB
+    // to validate the change, on every CPU for the shared kernel half
     flush_tlb((unsigned long) virtualaddr);
+    if ((unsigned long) virtualaddr >= KERNEL_VIRTUAL_BASE)
+        smp_flush_tlb((unsigned long) virtualaddr);
 }
 
 static void page_fault(registers_t *regs) {
     uint32_t cr2;
     asm volatile ("mov %%cr2, %0" : "=r" (cr2));
 
+    if (this_cpu()->running_thread)
+        this_cpu()->running_thread->faults++;
+
+    // A write to a present page may just be a copy-on-write one,
+    // a missing page may belong to an area not populated yet
+    if ((regs->err_code & 0x3) == 0x3 && cow_fault(cr2))
+        return;
+    if (!(regs->err_code & 0x1) && vm_fault(cr2, regs->err_code))
+        return;
+
     kprintf("Page fault at 0x%x, faulting address 0x%x\n", regs->eip, cr2);
     kprintf("Error code: %x\n", regs->err_code);
     panic("");
     for (;;);
 }
 
-// Clones the current page directory
-// Returns the physycal address of the new directory
-pagedir_t * clone_actual_directory(){
-    unsigned long * source_pd = (unsigned long *) 0xFFFFF000;
-    unsigned long * dest_pd;
-    pagedir_t * dest_pd_physical = pm_alloc();
-    pagetable_t * dest_pt_physical;
-    unsigned long * pt;
-    int i;
-    // Copy first the page directory
-    dest_pd = mm_map(dest_pd_physical, PM_DIR_CLONE_ADDR, PAGE_WRITE | PAGE_USER);
-    memcpy(PM_DIR_CLONE_ADDR, source_pd, 4096);
-    // Now iterate over each one of the page tables
-    // and copy those who exist
-    for(i = 0; i < 1024; i++){
-        pt = ((unsigned long *) 0xFFC00000) + (0x400 * i);
-        if (pt != 0){
-            dest_pt_physical = pm_alloc();
-            mm_map(dest_pt_physical, PM_DIR_CLONE_ADDR, PAGE_WRITE | PAGE_USER);
-            memcpy(PM_DIR_CLONE_ADDR, ((unsigned long)pt & PAGE_MASK), 4096);
-            // Point the directory entry to the new page 
-            // with the same permitions
-            dest_pd[i] = ((unsigned long)pt & 0x7) |
-                    (unsigned long)dest_pt_physical;
+/* cow_fault() - gives a private copy of a shared frame to the writer
+ *
+ * The last address space holding the frame just gets it back writable.
+ * Returns 0 if the page was not a copy-on-write one.
+ */
+static int cow_fault(unsigned long virtualaddr) {
+    pte_t * pde = PDE_OF(virtualaddr);
+    pte_t * pte = PTE_OF(virtualaddr);
+    pm_frame_t * f;
+    phys_addr_t copy;
+    uint32_t flags, shared;
+
+    if (!(*pde & PAGE_PRESENT) || (*pde & PAGE_LARGE) || !(*pte & PAGE_COW))
+        return 0;
+
+    f = pm_frame_of(*pte & PTE_ADDR_MASK);
+    if (f && f->refs) {
+        copy = pm_alloc();
+        mm_map(copy, PM_PAGE_CLONE_ADDR, PAGE_WRITE);
+        memcpy((uint8_t *) PM_PAGE_CLONE_ADDR, (uint8_t *) (virtualaddr & PAGE_MASK), 4096);
+        mm_unmap(PM_PAGE_CLONE_ADDR);
+        // The other users may have dropped the frame meanwhile
+        flags = spin_lock_irqsave(&sys_base->pm_lock);
+        if ((shared = f->refs))
+            f->refs--;
+        spin_unlock_irqrestore(&sys_base->pm_lock, flags);
+        if (shared)
+            *pte = copy | (*pte & 0xFFF);
+        else
+            pm_free(copy);
+    }
+    *pte = (*pte & ~(pte_t) PAGE_COW) | PAGE_WRITE;
+    flush_tlb(virtualaddr);
+    return 1;
+}
+
+/* clone_actual_directory() - copy-on-write clone of the current address space
+ *
+ * The kernel half and the boot identity map are shared as they are.
+ * Only the user page tables are copied: the frames they point to get
+ * one more reference and their writable entries become read-only
+ * PAGE_COW ones, in both spaces, until page_fault() splits them.
+ * Returns the physical address of the new directory (the PDPT with PAE).
+ */
+pagedir_t * clone_actual_directory() {
+    pte_t * source_pd = (pte_t *) PD_WINDOW;
+    pte_t * dest_pd = (pte_t *) PM_DIR_CLONE_ADDR;
+    pte_t * source_pt, * dest_pt;
+    phys_addr_t dest_pd_physical[PD_PAGES], dest_pt_physical;
+    pm_frame_t * f;
+    unsigned long i, j, self = (unsigned long) PT_WINDOW >> PT_SHIFT;
+    uint32_t flags;
+#ifdef CONFIG_PAE
+    uint64_t * dest_pdpt;
+    // CR3 and the PDPT entries only hold 32-bit addresses
+    phys_addr_t dest_pdpt_physical = pm_alloc_low();
+#endif
+
+    for (i = 0; i < PD_PAGES; i++) {
+        dest_pd_physical[i] = pm_alloc_low();
+        mm_map(dest_pd_physical[i], (char *) PM_DIR_CLONE_ADDR + i * 4096, PAGE_WRITE);
+    }
+
+    for (i = 0; i < PD_ENTRIES; i++) {
+        if (!(source_pd[i] & PAGE_PRESENT) || (source_pd[i] & PAGE_LARGE) ||
+            i < (0x400000 >> PT_SHIFT) || i >= (KERNEL_VIRTUAL_BASE >> PT_SHIFT)) {
+            dest_pd[i] = source_pd[i];
+            continue;
+        }
+        // Copy the user page table, sharing its frames
+        dest_pt_physical = pm_alloc();
+        dest_pt = mm_map(dest_pt_physical, PM_PAGE_CLONE_ADDR, PAGE_WRITE);
+        source_pt = PTE_OF(i << PT_SHIFT);
+        for (j = 0; j < 4096 / sizeof (pte_t); j++) {
+            if ((source_pt[j] & PAGE_PRESENT) &&
+                (f = pm_frame_of(source_pt[j] & PTE_ADDR_MASK))) {
+                flags = spin_lock_irqsave(&sys_base->pm_lock);
+                f->refs++;
+                spin_unlock_irqrestore(&sys_base->pm_lock, flags);
+                if (source_pt[j] & PAGE_WRITE) {
+                    source_pt[j] = (source_pt[j] & ~(pte_t) PAGE_WRITE) | PAGE_COW;
+                    flush_tlb((i << PT_SHIFT) + (j << 12));
+                }
+            }
+            dest_pt[j] = source_pt[j];
         }
+        dest_pd[i] = dest_pt_physical | (source_pd[i] & 0xFFF);
+    }
+    mm_unmap(PM_PAGE_CLONE_ADDR);
+
+    // The new directory references itself, not the current one
+    for (i = 0; i < PD_PAGES; i++) {
+        dest_pd[self + i] = dest_pd_physical[i] | 0x3;
+        mm_unmap((char *) PM_DIR_CLONE_ADDR + i * 4096);
     }
-    return dest_pd_physical;
+
+#ifdef CONFIG_PAE
+    dest_pdpt = mm_map(dest_pdpt_physical, PM_DIR_CLONE_ADDR, PAGE_WRITE);
+    memset((uint8_t *) dest_pdpt, 0, 4096);
+    for (i = 0; i < 4; i++)
+        dest_pdpt[i] = dest_pd_physical[i] | 0x1;
+    mm_unmap(PM_DIR_CLONE_ADDR);
+    return (pagedir_t *) (unsigned long) dest_pdpt_physical;
+#else
+    return (pagedir_t *) dest_pd_physical[0];
+#endif
 }
 
 /* flush_tlb(virtualaddr) - TLB entry invalidation function
@@ -350,98 +702,409 @@ static inline void flush_tlb(unsigned long virtualaddr) {
 }
 
 /**************************************************
- * The next functions came with the JamesM tutorial
- * so they will be presented as in the tutorial
- * with minor name changing and bug fixing
+ * Kernel heap chunk helpers. These started with the
+ * JamesM tutorial and were reworked to use boundary
+ * tags and segregated free bins
  **************************************************/
 
-static void glue_chunk (heap_header_t *chunk)
+/* Writes the header and the footer tags of a chunk */
+static inline void set_chunk(heap_header_t *chunk, uint32_t len, uint32_t allocated)
 {
-  if (chunk->next && chunk->next->allocated == 0)
-  {
-    chunk->length = chunk->length + chunk->next->length;
-    chunk->next->next->prev = chunk;
-    chunk->next = chunk->next->next;
-  }
+  heap_footer_t *footer = (heap_footer_t *)((uint32_t)chunk + len - sizeof (heap_footer_t));
 
-  if (chunk->prev && chunk->prev->allocated == 0)
-  {
-    chunk->prev->length = chunk->prev->length + chunk->length;
+  chunk->length = footer->length = len;
+  chunk->allocated = footer->allocated = allocated;
+}
+
+/* Bin index of a chunk: the position of the highest bit of its length */
+static inline int chunk_bin(uint32_t len)
+{
+  return 31 - __builtin_clz (len);
+}
+
+static void bin_insert (heap_header_t *chunk)
+{
+  int bin = chunk_bin (chunk->length);
+
+  chunk->prev = 0;
+  chunk->next = sys_base->sh_heap_bins[bin];
+  if (chunk->next)
+    chunk->next->prev = chunk;
+  sys_base->sh_heap_bins[bin] = chunk;
+  sys_base->sh_heap_bin_map |= (1 << bin);
+}
+
+static void bin_remove (heap_header_t *chunk)
+{
+  int bin = chunk_bin (chunk->length);
+
+  if (chunk->prev)
     chunk->prev->next = chunk->next;
+  else
+    sys_base->sh_heap_bins[bin] = chunk->next;
+  if (chunk->next)
     chunk->next->prev = chunk->prev;
-    chunk = chunk->prev;
-  }
+  if (!sys_base->sh_heap_bins[bin])
+    sys_base->sh_heap_bin_map &= ~(1 << bin);
+}
 
-  if (chunk->next == 0)
-    free_chunk (chunk);
+/* Looks for the best fitting chunk among the ones in the bin of len,
+ * or takes the first chunk of the next non-empty bin, all of which fit */
+static heap_header_t *find_chunk (uint32_t len)
+{
+  int bin = chunk_bin (len);
+  heap_header_t *chunk, *best = 0;
+  uint32_t map;
+
+  for (chunk = sys_base->sh_heap_bins[bin]; chunk; chunk = chunk->next)
+    if (chunk->length >= len && (!best || chunk->length < best->length))
+      best = chunk;
+  if (best)
+    return best;
+
+  if (bin == 31)
+    return 0;
+  map = sys_base->sh_heap_bin_map & ~((2 << bin) - 1);
+  if (!map)
+    return 0;
+  return sys_base->sh_heap_bins[__builtin_ctz (map)];
 }
 
+/* Releases the last chunk of the heap, and the pages above it.
+   The large pages mapped at boot are kept: their directory entries
+   were copied into every address space cloned since */
 static void free_chunk (heap_header_t *chunk)
 {
-  chunk->prev->next = 0;
-
-  if (chunk->prev == 0)
-  sys_base->sh_heap = 0;
+  sys_base->sh_heap_top = (uint32_t)chunk;
 
-  // While the heap max can contract by a page and still be greater than the chunk address...
-  while ( (sys_base->sh_heap_max-0x1000) >= (uint32_t)chunk )
+  // While the heap max can contract by a page
+  // and still be greater than the chunk address...
+  while (sys_base->sh_heap_max - 0x1000 >= (uint32_t)chunk)
   {
+    if (*PDE_OF(sys_base->sh_heap_max - 0x1000) & PAGE_LARGE)
+      break;
     sys_base->sh_heap_max -= 0x1000;
-    uint32_t page = get_physaddr (sys_base->sh_heap_max);
-    pm_free (page);
-    mm_unmap (sys_base->sh_heap_max);
+    pm_free (get_physaddr ((void*)sys_base->sh_heap_max));
+    mm_unmap ((void*)sys_base->sh_heap_max);
   }
 }
 
 static void split_chunk(heap_header_t *chunk, uint32_t len) {
     // In order to split a chunk, once we split we need to know that there will be enough
-    // space in the new chunk to store the chunk header, otherwise it just isn't worthwhile.
-    if (chunk->length - len > sizeof (heap_header_t)) {
-        heap_header_t *newchunk = (heap_header_t *) ((uint32_t) chunk + chunk->length);
-        newchunk->prev = chunk;
-        newchunk->next = 0;
-        newchunk->allocated = 0;
-        newchunk->length = chunk->length - len;
-        chunk->next = newchunk;
-        chunk->length = len;
+    // space in the new chunk to store the boundary tags, otherwise it just isn't worthwhile.
+    if (chunk->length - len > sizeof (heap_header_t) + sizeof (heap_footer_t)) {
+        heap_header_t *newchunk = (heap_header_t *) ((uint32_t) chunk + len);
+        set_chunk(newchunk, chunk->length - len, 0);
+        bin_insert(newchunk);
+        set_chunk(chunk, len, chunk->allocated);
     }
 }
 
 static void alloc_chunk(uint32_t start, uint32_t len) {
+    phys_addr_t block;
+
     while (start + len > sys_base->sh_heap_max) {
-        uint32_t page = pm_alloc();
-        mm_map(page, sys_base->sh_heap_max, PAGE_WRITE | PAGE_USER);
-        sys_base->sh_heap_max += 0x1000;
+        if (start + len > VM_STACK_START)
+            panic("Out of kernel heap space.\n");
+        // Grow by a whole large page when the heap end is aligned to one,
+        // until vm_init() gives the heap the page tables all spaces share
+        if (page_large && !(sys_base->sh_heap_max & (LARGE_PAGE_SIZE - 1)) &&
+            !(*PDE_OF(sys_base->sh_heap_max) & PAGE_PRESENT) &&
+            (block = pm_alloc_order(LARGE_PAGE_ORDER))) {
+            mm_map_large(block, (void*) sys_base->sh_heap_max, PAGE_WRITE | PAGE_USER);
+            sys_base->sh_heap_max += LARGE_PAGE_SIZE;
+        } else {
+            mm_map(pm_alloc(), (void*) sys_base->sh_heap_max, PAGE_WRITE | PAGE_USER);
+            sys_base->sh_heap_max += 0x1000;
+        }
     }
 }
 
 
-unsigned int pm_alloc() {
-    unsigned long page_to_be_returned;
+/**************************************************
+ * Physical page frame allocator.
+ * Free memory is kept by a binary buddy system: a free
+ * block of 2^order frames is headed by its first frame
+ * descriptor and linked in pm_free_area[order]. The buddy
+ * of a block is found by flipping bit 'order' of its frame
+ * number, so splitting and merging take O(log n).
+ **************************************************/
+
+/* pm_alloc_order() - allocates 2^order physically contiguous frames
+ *
+ * Returns the physical address of the first frame, or 0 if no block
+ * that big is free
+ */
+phys_addr_t pm_alloc_order(unsigned int order) {
+    uint32_t frame, o, flags, low;
+
+    if (order > PM_MAX_ORDER)
+        return 0;
+
+    // Before the frame descriptors exist, pages are handed out linearly
+    if (sys_base->vm_online == 0)
+        return order ? 0 : (sys_base->pm_last_page += 0x1000);
+
+    // Find the smallest free block that is big enough,
+    // carving more RAM into the buddy allocator if there is none...
+    flags = spin_lock_irqsave(&sys_base->pm_lock);
+    for (;;) {
+        for (o = order; o <= PM_MAX_ORDER && sys_base->pm_free_area[o].count == 0; o++);
+        if (o <= PM_MAX_ORDER)
+            break;
+        // pm_carve() allocates frames itself
+        spin_unlock_irqrestore(&sys_base->pm_lock, flags);
+        if (!pm_carve())
+            return 0;
+        flags = spin_lock_irqsave(&sys_base->pm_lock);
+    }
 
-    if (sys_base->vm_online == 0 || sys_base->mm_free_page_stack_ptr == PM_STACK_ADDR)
-        page_to_be_returned = sys_base->pm_last_page += 0x1000;
-    else {
-        (sys_base->mm_free_page_stack_ptr)--;
-        page_to_be_returned = *(sys_base->mm_free_page_stack_ptr);
+    frame = sys_base->pm_free_area[o].head;
+    frame_unlink(frame);
+    // ... and split it, giving the upper halves back to the lower orders
+    while (o > order) {
+        o--;
+        frame_push(frame + (1 << o), o);
     }
-    (sys_base->free_pages)--;
+    sys_base->pm_frames[frame].order = order;
+    sys_base->free_pages -= (1 << order);
+    low = sys_base->free_pages < PM_CARVE_WATERMARK;
+    spin_unlock_irqrestore(&sys_base->pm_lock, flags);
+    // Keep a few frames around, so the next chunk can always be carved
+    if (low)
+        pm_carve();
+    return (phys_addr_t) frame << 12;
+}
+
+/* pm_free_order() - gives back a block allocated by pm_alloc_order() */
+void pm_free_order(phys_addr_t page, unsigned int order) {
+    uint32_t flags = spin_lock_irqsave(&sys_base->pm_lock);
+
+    buddy_free(page, order);
+    spin_unlock_irqrestore(&sys_base->pm_lock, flags);
+}
+
+phys_addr_t pm_alloc() {
+    phys_addr_t page_to_be_returned = pm_alloc_order(0);
+
+    if (!page_to_be_returned)
+        panic("Out of physical memory.\n");
     return page_to_be_returned;
 }
 
-void pm_free(unsigned int page) {
+/* pm_alloc_low() - allocates a frame below 4GiB
+ *
+ * For the paging structures CR3 and the PDPT point to, which are 32-bit
+ * physical addresses even with PAE. The free lists are searched for a
+ * low block, carving more RAM while there is none.
+ */
+phys_addr_t pm_alloc_low() {
+    uint32_t frame, o, flags;
+
+    if (sys_base->vm_online == 0)
+        return pm_alloc();
+
+    flags = spin_lock_irqsave(&sys_base->pm_lock);
+    for (;;) {
+        for (o = 0; o <= PM_MAX_ORDER; o++)
+            for (frame = sys_base->pm_free_area[o].head; frame != PM_NO_FRAME;
+                 frame = sys_base->pm_frames[frame].next)
+                if (frame < PM_LOW_FRAMES)
+                    goto found;
+        spin_unlock_irqrestore(&sys_base->pm_lock, flags);
+        if (!pm_carve())
+            panic("Out of physical memory below 4GiB.\n");
+        flags = spin_lock_irqsave(&sys_base->pm_lock);
+    }
+
+found:
+    frame_unlink(frame);
+    while (o > 0) {
+        o--;
+        frame_push(frame + (1 << o), o);
+    }
+    sys_base->pm_frames[frame].order = 0;
+    sys_base->free_pages--;
+    spin_unlock_irqrestore(&sys_base->pm_lock, flags);
+    return (phys_addr_t) frame << 12;
+}
+
+void pm_free(phys_addr_t page) {
+    pm_frame_t *f = pm_frame_of(page);
+    uint32_t flags;
+
     // Sanity test to not overwrite kernel nor zeropage when freeing pages
-    if( (page > (sys_base->pm_last_page - 0x10000)) ||
-        (page > 0x100000 && page < kernel_seg_end_page) ||
-        (page < 0x20000)) return;
+    if (!f) return;
+
+    // A shared frame is only dropped by one of its users
+    flags = spin_lock_irqsave(&sys_base->pm_lock);
+    if (f->refs)
+        f->refs--;
+    else
+        buddy_free(page & PAGE_MASK, 0);
+    spin_unlock_irqrestore(&sys_base->pm_lock, flags);
+}
 
-    if (sys_base->mm_free_page_stack_ptr >= sys_base->mm_free_page_stack_max){
-        mm_map((void*) page, sys_base->mm_free_page_stack_ptr, PAGE_WRITE | PAGE_USER);
-        sys_base->mm_free_page_stack_max += 4096;
+/* pm_frame_of() - descriptor of a frame the buddy allocator manages
+ *
+ * Returns NULL for the zeropage, the kernel, the boot-time pages,
+ * memory holes and RAM that is not carved yet
+ */
+static pm_frame_t * pm_frame_of(phys_addr_t page) {
+    uint32_t frame = page >> 12, r;
+
+    if ((page >= PM_KERNEL_START && page <= sys_base->pm_last_page) ||
+        page < PM_LOW_RESERVED ||
+        frame >= (sys_base->pm_next_chunk << PM_MAX_ORDER))
+        return NULL;
+    for (r = 0; r < sys_base->pm_num_regions; r++)
+        if (frame >= sys_base->pm_regions[r].first &&
+            frame < sys_base->pm_regions[r].last)
+            return &sys_base->pm_frames[frame];
+    return NULL;
+}
+
+/* pm_carve() - hands the next 4MiB chunk of RAM to the buddy allocator
+ *
+ * The descriptors of the chunk frames are taken from the frames carved
+ * so far (from the boot-time pages for the first chunk), so that every
+ * chunk can be handed out as a whole 4MiB block. Called when the
+ * allocator runs low, and by the idle loop.
+ * Returns 0 when nothing was carved.
+ */
+int pm_carve() {
+    uint32_t first, last, r, flags;
+    unsigned long desc, n;
+    pm_region_t *region;
+    int carved = 0;
+
+    // One CPU carves at a time, the allocations it does meanwhile
+    // must not carve again
+    flags = spin_lock_irqsave(&sys_base->pm_lock);
+    if (pm_carving) {
+        spin_unlock_irqrestore(&sys_base->pm_lock, flags);
+        return 0;
     }
-    else {
-        *(sys_base->mm_free_page_stack_ptr) = page;
-        (sys_base->mm_free_page_stack_ptr)++;
-        (sys_base->free_pages)++;
+    pm_carving = 1;
+
+    while (sys_base->pm_next_chunk < sys_base->pm_num_chunks) {
+        first = sys_base->pm_next_chunk << PM_MAX_ORDER;
+        last = first + (1 << PM_MAX_ORDER);
+
+        // Skip the chunks with no RAM in them
+        for (r = 0; r < sys_base->pm_num_regions; r++)
+            if (sys_base->pm_regions[r].first < last &&
+                sys_base->pm_regions[r].last > first)
+                break;
+        if (r == sys_base->pm_num_regions) {
+            sys_base->pm_next_chunk++;
+            continue;
+        }
+
+        // Make sure the descriptors can be allocated
+        if (sys_base->vm_online && sys_base->free_pages < (PM_CHUNK_DESC_SIZE >> 12))
+            break;
+        sys_base->pm_next_chunk++;
+
+        // Map and clear the descriptors of the chunk...
+        spin_unlock_irqrestore(&sys_base->pm_lock, flags);
+        desc = PM_FRAMES_ADDR + (first >> PM_MAX_ORDER) * PM_CHUNK_DESC_SIZE;
+        for (n = 0; n < PM_CHUNK_DESC_SIZE; n += 0x1000) {
+            mm_map(pm_alloc_order(0), (void*) (desc + n), PAGE_WRITE);
+            memset((uint8_t *) (desc + n), 0, 0x1000);
+        }
+        flags = spin_lock_irqsave(&sys_base->pm_lock);
+
+        // ... then free all of its RAM
+        for (r = 0; r < sys_base->pm_num_regions; r++) {
+            region = &sys_base->pm_regions[r];
+            pm_add_range(region->first > first ? region->first : first,
+                    region->last < last ? region->last : last);
+        }
+        carved = 1;
+        break;
+    }
+
+    pm_carving = 0;
+    spin_unlock_irqrestore(&sys_base->pm_lock, flags);
+    return carved;
+}
+
+/* pm_add_range() - frees the usable frames in [first, last) */
+static void pm_add_range(uint32_t first, uint32_t last) {
+    uint32_t kernel_first = PM_KERNEL_START >> 12;
+    uint32_t kernel_last = (sys_base->pm_last_page >> 12) + 1;
+    uint32_t order;
+
+    // Leave out the zeropage, the kernel and the boot-time pages
+    if (first < (PM_LOW_RESERVED >> 12))
+        first = PM_LOW_RESERVED >> 12;
+    if (last > sys_base->pm_max_frame)
+        last = sys_base->pm_max_frame;
+    if (first < kernel_last && last > kernel_first) {
+        pm_add_range(first, kernel_first);
+        first = kernel_last;
     }
-}
\ No newline at end of file
+
+    // Free the range in the biggest naturally aligned blocks that fit
+    while (first < last) {
+        for (order = PM_MAX_ORDER;
+             (first & ((1 << order) - 1)) || first + (1 << order) > last;
+             order--);
+        buddy_free((phys_addr_t) first << 12, order);
+        first += (1 << order);
+    }
+}
+
+/* Pushes a free block on the list of its order */
+static void frame_push(uint32_t frame, uint32_t order) {
+    pm_frame_t *f = &sys_base->pm_frames[frame];
+    pm_free_area_t *area = &sys_base->pm_free_area[order];
+
+    f->flags |= PF_FREE;
+    f->order = order;
+    f->prev = PM_NO_FRAME;
+    f->next = area->head;
+    if (f->next != PM_NO_FRAME)
+        sys_base->pm_frames[f->next].prev = frame;
+    area->head = frame;
+    area->count++;
+}
+
+/* Takes a free block out of the list of its order */
+static void frame_unlink(uint32_t frame) {
+    pm_frame_t *f = &sys_base->pm_frames[frame];
+    pm_free_area_t *area = &sys_base->pm_free_area[f->order];
+
+    if (f->prev != PM_NO_FRAME)
+        sys_base->pm_frames[f->prev].next = f->next;
+    else
+        area->head = f->next;
+    if (f->next != PM_NO_FRAME)
+        sys_base->pm_frames[f->next].prev = f->prev;
+    f->flags &= ~PF_FREE;
+    area->count--;
+}
+
+/* Frees a block, merging it with its buddy as long as the buddy is free
+ * too. Called with the pm_lock held */
+static void buddy_free(phys_addr_t page, unsigned int order) {
+    uint32_t frame = (uint32_t) (page >> 12), buddy;
+
+    if (order > PM_MAX_ORDER || frame + (1 << order) > sys_base->pm_max_frame ||
+        (sys_base->pm_frames[frame].flags & PF_FREE))
+        return;
+
+    sys_base->free_pages += (1 << order);
+    while (order < PM_MAX_ORDER) {
+        buddy = frame ^ (1 << order);
+        if (buddy >= sys_base->pm_max_frame ||
+            !(sys_base->pm_frames[buddy].flags & PF_FREE) ||
+            sys_base->pm_frames[buddy].order != order)
+            break;
+        frame_unlink(buddy);
+        frame &= ~(1 << order);
+        order++;
+    }
+    frame_push(frame, order);
+}
@@ -15,35 +15,124 @@
 #define PAGE_PRESENT   0x1        // Page is mapped in.
 #define PAGE_WRITE     0x2        // Page is writable. Not set means read-only.
 #define PAGE_USER      0x4        // Page is writable from user space. Unset means kernel-only.
+#define PAGE_NOCACHE   0x10       // Caching disabled, for device registers.
+#define PAGE_LARGE     0x80       // Directory entry maps a large page, not a page table.
+#define PAGE_GLOBAL    0x100      // Page survives CR3 reloads (kernel mappings only).
+#define PAGE_COW       0x200      // Read-only alias of a shared frame, copied on write.
 #define PAGE_MASK      0xFFFFF000 // Mask constant to page-align an address.
 
+#define KERNEL_VIRTUAL_BASE 0xC0000000 // Start of the kernel's higher half
+#define SH_HEAP_START  (unsigned long) 0xC0400000 // Kernel heap, up to the thread stacks
+
 typedef unsigned long pagedir_t;
 typedef unsigned long pagetable_t;
 
+/* Page table entries and physical addresses. Building with CONFIG_PAE
+ * selects the 3-level PAE paging mode, with 64-bit entries able to
+ * point to frames above 4GiB. */
+#ifdef CONFIG_PAE
+typedef uint64_t pte_t;
+typedef uint64_t phys_addr_t;
+#define PT_SHIFT       21         // Each page table maps 2MiB
+#define PD_PAGES       4          // One page directory per PDPT entry
+#else
+typedef unsigned long pte_t;
+typedef unsigned long phys_addr_t;
+#define PT_SHIFT       22         // Each page table maps 4MiB
+#define PD_PAGES       1
+#endif
+#define PD_ENTRIES     (PD_PAGES * 4096 / sizeof (pte_t))
+/* A large page covers what a whole page table would (4MiB, 2MiB with PAE) */
+#define LARGE_PAGE_SIZE  (1UL << PT_SHIFT)
+#define LARGE_PAGE_ORDER (PT_SHIFT - 12)
+
+#define HEAP_NUM_BINS  32         // Free chunk bins, one per power of two
+
+/* Heap chunk boundary tags: every chunk starts with a header and ends with
+ * a footer, both holding the chunk length (tags included), so the
+ * neighbours of a chunk can be found in constant time. */
 typedef struct heap_header
 {
-    struct heap_header *next, *prev;   // node linkage fields
+    struct heap_header *next, *prev;   // free bin linkage fields
     uint32_t allocated : 1;
     uint32_t length : 31;
 } __attribute__((packed)) heap_header_t;
 
+typedef struct heap_footer
+{
+    uint32_t allocated : 1;
+    uint32_t length : 31;
+} __attribute__((packed)) heap_footer_t;
+
+#define PM_MAX_ORDER   10         // Largest buddy block: 2^10 frames (4MiB)
+#define PM_NO_FRAME    0xFFFFFFFF // Free list terminator
+
+#define PF_FREE        0x1        // Frame heads a free buddy block
+
+#define PM_LOW_FRAMES  0x100000   // Frames below 4GiB, the ones a 32-bit CR3 can hold
+
+/* Physical frame descriptor, one per 4kB frame of RAM */
+typedef struct pm_frame
+{
+    uint32_t next, prev;   // free list linkage fields (frame numbers)
+    uint8_t order;         // order of the block headed by this frame
+    uint8_t flags;         // PF_* flags
+    uint16_t refs;         // extra address spaces sharing the frame
+} __attribute__((packed)) pm_frame_t;
+
+/* Frame descriptors take exactly 3 pages per 4MiB chunk */
+#define PM_CHUNK_DESC_SIZE ((1 << PM_MAX_ORDER) * sizeof (pm_frame_t))
+#define PM_MAX_REGIONS 16         // Usable RAM regions kept from the memory map
+
+/* A region of usable RAM, as frame numbers [first, last) */
+typedef struct pm_region
+{
+    uint32_t first;
+    uint32_t last;
+} __attribute__((packed)) pm_region_t;
+
+/* Free blocks of one order */
+typedef struct pm_free_area
+{
+    uint32_t head;         // first free block (frame number)
+    uint32_t count;        // number of free blocks
+} __attribute__((packed)) pm_free_area_t;
+
 void mm_init(multiboot_t * mboot);
 
-unsigned int pm_alloc();
+phys_addr_t pm_alloc();
+
+phys_addr_t pm_alloc_low();
+
+void pm_free(phys_addr_t page);
+
+phys_addr_t pm_alloc_order(unsigned int order);
+
+void pm_free_order(phys_addr_t page, unsigned int order);
 
-void pm_free(unsigned int page);
+int pm_carve();
 
-void * get_physaddr(void * virtualaddr);
+phys_addr_t get_physaddr(void * virtualaddr);
 
-void * mm_map(void * physaddr, void * virtualaddr, unsigned int flags);
+unsigned int get_pageflags(void * virtualaddr);
+
+void * mm_map(phys_addr_t physaddr, void * virtualaddr, unsigned int flags);
+
+void * mm_map_large(phys_addr_t physaddr, void * virtualaddr, unsigned int flags);
+
+void mm_map_pagetables(void * start, void * end, unsigned int flags);
 
 void mm_unmap(void * virtualaddr);
 
+void * phys_to_virt(phys_addr_t physaddr);
+
 void *kmalloc(uint32_t l);
 
 void kfree (void *p);
 
 void switch_page_directory(void *pagetabledir_ptr);
 
+pagedir_t * clone_actual_directory();
+
 #endif	/* _PMM_H */
 
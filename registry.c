@@ -0,0 +1,130 @@
+/* registry.c - Krypton kernel name registry
+ *
+ * Names are hashed with FNV-1a, together with the node type, so a thread
+ * and its message port may share the same name. Lookups only compare
+ * the names of the entries whose hash matches.
+ */
+
+#include "registry.h"
+#include "sysbase.h"
+#include "common.h"
+#include "pmm.h"
+
+/***************************************
+ * Static Function Prototypes
+ ***************************************/
+static uint32_t name_hash(char *name, uint32_t type);
+
+static inline uint32_t addr_bucket(list_node_t *node);
+
+/* name_init() - empties the registry */
+void name_init() {
+    int i;
+
+    for (i = 0; i < NAME_HASH_SIZE; i++) {
+        sys_base->name_hash[i] = NULL;
+        sys_base->addr_hash[i] = NULL;
+    }
+}
+
+/* name_register() - makes a node known to name_registered(), and a named
+ * one to name_lookup() too
+ */
+void name_register(list_node_t *node) {
+    name_entry_t *entry = (name_entry_t *) kmalloc(sizeof (name_entry_t));
+    uint32_t bucket = addr_bucket(node);
+
+    entry->node = node;
+    entry->hash = 0;
+    if (node->name) {
+        entry->hash = name_hash(node->name, node->type);
+        entry->next = sys_base->name_hash[entry->hash & (NAME_HASH_SIZE - 1)];
+        sys_base->name_hash[entry->hash & (NAME_HASH_SIZE - 1)] = entry;
+    }
+    entry->addr_next = sys_base->addr_hash[bucket];
+    sys_base->addr_hash[bucket] = entry;
+}
+
+/* name_unregister() - drops a node from the registry */
+void name_unregister(list_node_t *node) {
+    name_entry_t *entry, *prev = NULL;
+    uint32_t bucket = addr_bucket(node);
+
+    for (entry = sys_base->addr_hash[bucket]; entry; prev = entry, entry = entry->addr_next)
+        if (entry->node == node)
+            break;
+    if (!entry)
+        return;
+    if (prev)
+        prev->addr_next = entry->addr_next;
+    else
+        sys_base->addr_hash[bucket] = entry->addr_next;
+
+    // A nameless node is in no name bucket, and is just not found there
+    bucket = entry->hash & (NAME_HASH_SIZE - 1);
+    if (sys_base->name_hash[bucket] == entry)
+        sys_base->name_hash[bucket] = entry->next;
+    else
+        for (prev = sys_base->name_hash[bucket]; prev; prev = prev->next)
+            if (prev->next == entry) {
+                prev->next = entry->next;
+                break;
+            }
+    kfree(entry);
+}
+
+/* name_lookup() - finds a node by name and type
+ *
+ * Returns the node registered last under that name, or NULL
+ */
+list_node_t * name_lookup(char *name, uint32_t type) {
+    uint32_t hash = name_hash(name, type);
+    name_entry_t *entry = sys_base->name_hash[hash & (NAME_HASH_SIZE - 1)];
+
+    for (; entry; entry = entry->next)
+        if (entry->hash == hash && entry->node->type == type &&
+            strcmp(entry->node->name, name) == 0)
+            return entry->node;
+    return NULL;
+}
+
+/* name_registered() - tells if a node of that type is in the registry
+ *
+ * Searches by the node address, so a handle handed in by ring 3 can be
+ * checked without following anything it points to.
+ */
+int name_registered(list_node_t *node, uint32_t type) {
+    name_entry_t *entry;
+
+    for (entry = sys_base->addr_hash[addr_bucket(node)]; entry; entry = entry->addr_next)
+        if (entry->node == node)
+            return node->type == type;
+    return 0;
+}
+
+/* add_named() - adds a node to the tail of a list and registers it */
+void add_named(list_head_t *list, list_node_t *node) {
+    add_tail(list, node);
+    name_register(node);
+}
+
+/* remove_named() - unlinks a node from its list and the registry */
+void remove_named(list_node_t *node) {
+    remove(node);
+    name_unregister(node);
+}
+
+static uint32_t name_hash(char *name, uint32_t type) {
+    uint32_t hash = 2166136261u ^ type;
+
+    while (*name) {
+        hash ^= (uint8_t) *name++;
+        hash *= 16777619;
+    }
+    return hash;
+}
+
+/* addr_bucket() - address hash bucket of a node, by Fibonacci hashing */
+static inline uint32_t addr_bucket(list_node_t *node) {
+    return ((uint32_t) node * 2654435761u) >> (32 - NAME_HASH_BITS);
+}
@@ -0,0 +1,42 @@
+/*
+ * File:   registry.h
+ * Author: renato
+ *
+ * Kernel name registry. Named nodes (threads, message ports, devices,
+ * libraries and resources) are hashed by name and node type, so they
+ * can be found without walking the lists they are linked in. Every
+ * registered node, named or not, is also hashed by its address, so a
+ * handle handed in by ring 3 is checked in constant time.
+ */
+
+#ifndef _REGISTRY_H
+#define	_REGISTRY_H
+
+#include "common.h"
+
+#define NAME_HASH_BITS  8
+#define NAME_HASH_SIZE  (1 << NAME_HASH_BITS) // Buckets in each hash table
+
+/* Hash chain entry pointing to a registered node */
+typedef struct name_entry {
+    struct name_entry *next;    // Next entry in the same name bucket
+    struct name_entry *addr_next; // Next entry in the same address bucket
+    list_node_t *node;          // Registered node
+    uint32_t hash;              // Hash of the node name and type, if named
+} __attribute__((packed)) name_entry_t;
+
+void name_init();
+
+void name_register(list_node_t *node);
+
+void name_unregister(list_node_t *node);
+
+list_node_t * name_lookup(char *name, uint32_t type);
+
+int name_registered(list_node_t *node, uint32_t type);
+
+void add_named(list_head_t *list, list_node_t *node);
+
+void remove_named(list_node_t *node);
+
+#endif	/* _REGISTRY_H */
@@ -0,0 +1,200 @@
+/* ring.c - Krypton batched system calls
+ *
+ * The rings live in the shared heap, which ring 3 may write, so the
+ * kernel reads every submission once into a copy and checks it there,
+ * and trusts no index but its own.
+ */
+
+#include "ring.h"
+#include "sysbase.h"
+#include "message.h"
+#include "syscall.h"
+#include "vmm.h"
+#include "registry.h"
+
+/***************************************
+ * Static Function Prototypes
+ ***************************************/
+static uint32_t ring_run(thread_t *thread, int can_block);
+
+static uint32_t ring_op(ring_sqe_t *sqe);
+
+static inline int ring_cq_room(thread_t *thread);
+
+static void ring_complete(thread_t *thread, uint32_t user_data, uint32_t result);
+
+/* system call wrapper to get the ring of the running thread, set up on
+   the first call. flags (RING_POLL) replace the ones it had */
+sysring_t * ring_setup(uint32_t flags) {
+    return (sysring_t *) do_syscall(SYS_RING_SETUP, flags, 0, 0);
+}
+
+/* system call wrapper to run the queued submissions.
+   Returns the number of them taken */
+int ring_enter() {
+    return (int) do_syscall(SYS_RING_ENTER, 0, 0, 0);
+}
+
+/* ring_submit() - queues an operation, from the thread owning the ring
+ *
+ * Returns 0, or -1 if the submission ring is full
+ */
+int ring_submit(sysring_t *ring, uint32_t op, uint32_t arg1, uint32_t arg2,
+        uint32_t arg3, uint32_t user_data) {
+    uint32_t tail = ring->sq_tail;
+    ring_sqe_t * sqe;
+
+    if (tail - ring->sq_head >= RING_ENTRIES)
+        return -1;
+    sqe = &ring->sq[tail & (RING_ENTRIES - 1)];
+    sqe->op = op;
+    sqe->arg[0] = arg1;
+    sqe->arg[1] = arg2;
+    sqe->arg[2] = arg3;
+    sqe->user_data = user_data;
+    // The entry has to be there before the kernel can see it
+    ring_barrier();
+    ring->sq_tail = tail + 1;
+    return 0;
+}
+
+/* ring_reap() - takes the oldest completion, from the thread owning the ring
+ *
+ * Returns 0, or -1 if there is none
+ */
+int ring_reap(sysring_t *ring, ring_cqe_t *cqe) {
+    uint32_t head = ring->cq_head;
+
+    if (head == ring->cq_tail)
+        return -1;
+    ring_barrier();
+    *cqe = ring->cq[head & (RING_ENTRIES - 1)];
+    ring_barrier();
+    ring->cq_head = head + 1;
+    return 0;
+}
+
+/* _ring_setup() - gives a thread its ring, if it has none yet */
+sysring_t * _ring_setup(thread_t *thread, uint32_t flags) {
+    if (!thread->ring) {
+        thread->ring = (sysring_t *) kmalloc(sizeof (sysring_t));
+        memset((uint8_t *) thread->ring, 0, sizeof (sysring_t));
+        thread->ring_sq_head = 0;
+        thread->ring_cq_tail = 0;
+    }
+    thread->ring->flags = flags;
+    return thread->ring;
+}
+
+/* _ring_enter() - runs the submissions of the running thread */
+uint32_t _ring_enter(thread_t *thread) {
+    return ring_run(thread, 1);
+}
+
+/* ring_poll() - runs the submissions of a polled ring, on a timer tick
+ *
+ * Only when the tick interrupted the running thread in ring 3: the
+ * operations then run as if the thread had entered the kernel itself.
+ * A tick must not block the thread it interrupted, so a RING_OP_WAIT is
+ * left queued for the next ring_enter().
+ */
+void ring_poll(cpu_t *cpu) {
+    thread_t * thread = cpu->running_thread;
+
+    if (cpu->k_reenter == 0 && (thread->thread_flags & TS_RUN) &&
+        thread->ring && (thread->ring->flags & RING_POLL))
+        ring_run(thread, 0);
+}
+
+/* ring_wake() - completes the RING_OP_WAIT a signaled thread blocked in */
+void ring_wake(thread_t *thread, uint32_t sig_flags) {
+    if (!thread->ring_wait)
+        return;
+    thread->ring_wait = 0;
+    // ring_run() kept a completion free for it
+    ring_complete(thread, thread->ring_wait_data, sig_flags);
+}
+
+/* ring_run() - takes the submissions queued, in order
+ *
+ * Stops at a RING_OP_WAIT, after blocking in it if can_block is set, or
+ * when the completion ring is full. Returns the number of submissions
+ * taken.
+ */
+static uint32_t ring_run(thread_t *thread, int can_block) {
+    sysring_t * ring = thread->ring;
+    uint32_t tail, taken = 0;
+    ring_sqe_t sqe;
+
+    if (!ring || thread->ring_wait)
+        return 0;
+    tail = ring->sq_tail;
+    // A bogus tail is cut down to what the ring can hold
+    if (tail - thread->ring_sq_head > RING_ENTRIES)
+        tail = thread->ring_sq_head + RING_ENTRIES;
+    ring_barrier();
+
+    while (thread->ring_sq_head != tail && ring_cq_room(thread)) {
+        // The thread may rewrite the entry meanwhile, work on a copy
+        sqe = ring->sq[thread->ring_sq_head & (RING_ENTRIES - 1)];
+        if (sqe.op == RING_OP_WAIT && !can_block)
+            break;
+        thread->ring_sq_head++;
+        ring->sq_head = thread->ring_sq_head;
+        taken++;
+        if (sqe.op == RING_OP_WAIT) {
+            thread->ring_wait = 1;
+            thread->ring_wait_data = sqe.user_data;
+            _wait_timeout(sqe.arg[0], sqe.arg[1]);
+            break;
+        }
+        ring_complete(thread, sqe.user_data, ring_op(&sqe));
+    }
+    return taken;
+}
+
+/* ring_op() - runs a submission that does not block, for the running
+ * thread. Returns its result
+ */
+static uint32_t ring_op(ring_sqe_t *sqe) {
+    thread_t * target;
+    message_t * msg;
+
+    switch (sqe->op) {
+        case RING_OP_NOP:
+            return 0;
+        case RING_OP_POST:
+            target = (thread_t *) sqe->arg[0];
+            if (!target || !name_registered((list_node_t *) target, NT_THREAD) ||
+                sqe->arg[2] > MAX_MSG_SZ)
+                return SYSCALL_EINVAL;
+            if (!vm_user_access(sqe->arg[1], sqe->arg[2], 0))
+                return SYSCALL_EFAULT;
+            return _msg_try_post(target, (uint8_t *) sqe->arg[1], (uint16_t) sqe->arg[2]);
+        case RING_OP_RETRIEVE:
+            _msg_retrieve(&msg);
+            return (uint32_t) msg;
+        case RING_OP_CYCLE:
+            _msg_cycle();
+            return 0;
+        default:
+            return SYSCALL_ENOSYS;
+    }
+}
+
+/* ring_cq_room() - tells if the completion ring has a free entry */
+static inline int ring_cq_room(thread_t *thread) {
+    return thread->ring_cq_tail - thread->ring->cq_head < RING_ENTRIES;
+}
+
+/* ring_complete() - hands a result back in the completion ring */
+static void ring_complete(thread_t *thread, uint32_t user_data, uint32_t result) {
+    sysring_t * ring = thread->ring;
+    ring_cqe_t * cqe = &ring->cq[thread->ring_cq_tail & (RING_ENTRIES - 1)];
+
+    cqe->user_data = user_data;
+    cqe->result = result;
+    // The entry has to be there before the thread can see it
+    ring_barrier();
+    ring->cq_tail = ++thread->ring_cq_tail;
+}
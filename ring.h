@@ -0,0 +1,90 @@
+/*
+ * File:   ring.h
+ * Author: renato
+ *
+ * Batched system calls, through a submission/completion ring per thread.
+ *
+ * The thread queues operations in the submission ring and enters the
+ * kernel once with ring_enter(), which runs them in order and leaves a
+ * completion for each in the completion ring. With RING_POLL set, the
+ * timer tick of its CPU runs them too whenever it interrupts the thread
+ * in ring 3, so a thread that can afford a tick of latency never has to
+ * enter the kernel at all. The tick stops at a RING_OP_WAIT, only
+ * ring_enter() blocks in one.
+ *
+ * The thread only writes sq_tail, cq_head, flags and the submissions;
+ * the kernel only sq_head, cq_tail and the completions, and keeps its own
+ * copy of the indexes it owns in the thread. A submission is only taken
+ * while its completion has room, so completions are never lost.
+ *
+ * A RING_OP_WAIT blocks the thread like wait_timeout(): the submissions
+ * behind it wait for the next ring_enter() (or tick), and it completes
+ * when the thread is signaled, with the signals that woke it.
+ */
+
+#ifndef _RING_H
+#define	_RING_H
+
+#include "common.h"
+#include "thread.h"
+#include "smp.h"
+
+#define RING_ENTRIES    32  // Entries of each ring, a power of two
+
+#define RING_POLL       1   // Let the timer tick run the submissions
+
+/* Operations, and what their completions return */
+#define RING_OP_NOP     0   // Nothing, returns 0
+#define RING_OP_POST    1   // _msg_try_post(thread, buf, size), returns a MSG_* code
+#define RING_OP_RETRIEVE 2  // Returns the first message of the port, or 0
+#define RING_OP_CYCLE   3   // _msg_cycle(), returns 0
+#define RING_OP_WAIT    4   // wait_timeout(signals, ticks), returns the signals received
+
+/*! \brief Submission entry, filled by the thread. */
+typedef struct ring_sqe {
+    uint32_t op;                //!< RING_OP_*.
+    uint32_t arg[3];            //!< Operation arguments.
+    uint32_t user_data;         //!< Handed back in the completion.
+} __attribute__((packed)) ring_sqe_t;
+
+/*! \brief Completion entry, filled by the kernel. */
+typedef struct ring_cqe {
+    uint32_t user_data;         //!< As submitted.
+    uint32_t result;            //!< Operation result, or a SYSCALL_E* error.
+} __attribute__((packed)) ring_cqe_t;
+
+/*! \brief Submission and completion rings, shared by a thread and the kernel. */
+struct sysring_s {
+    volatile uint32_t sq_head;  //!< Next submission the kernel takes.
+    volatile uint32_t sq_tail;  //!< Next submission the thread fills.
+    volatile uint32_t cq_head;  //!< Next completion the thread reaps.
+    volatile uint32_t cq_tail;  //!< Next completion the kernel fills.
+    volatile uint32_t flags;    //!< RING_POLL.
+    ring_sqe_t sq[RING_ENTRIES];
+    ring_cqe_t cq[RING_ENTRIES];
+} __attribute__((packed));
+
+typedef struct sysring_s sysring_t;
+
+/* Keeps the compiler from moving memory accesses across the index updates.
+ * The processor does not reorder stores with stores, or loads with loads */
+#define ring_barrier()  asm volatile("" : : : "memory")
+
+sysring_t * ring_setup(uint32_t flags);
+
+int ring_enter();
+
+int ring_submit(sysring_t *ring, uint32_t op, uint32_t arg1, uint32_t arg2,
+        uint32_t arg3, uint32_t user_data);
+
+int ring_reap(sysring_t *ring, ring_cqe_t *cqe);
+
+sysring_t * _ring_setup(thread_t *thread, uint32_t flags);
+
+uint32_t _ring_enter(thread_t *thread);
+
+void ring_poll(cpu_t *cpu);
+
+void ring_wake(thread_t *thread, uint32_t sig_flags);
+
+#endif	/* _RING_H */
@@ -0,0 +1,232 @@
+/* semaphore.c - Krypton signal semaphores
+ *
+ * A thread that cannot obtain a semaphore queues its sem_node in the
+ * waiters and blocks with wait(ST_SEMAPHORE). The releaser hands the unit
+ * (and, for a mutex, the ownership) to the first waiter and signals it,
+ * so the system call of the waiter returns with the semaphore obtained.
+ *
+ * Priority inheritance: the owner of a mutex runs at the highest of its
+ * own priority and the priorities of the first waiters of the mutexes it
+ * holds. A raise follows the chain of owners blocked on other mutexes,
+ * up to SEM_PI_DEPTH of them, so a deadlock cycle cannot loop forever.
+ */
+
+#include "semaphore.h"
+#include "sysbase.h"
+#include "message.h"
+#include "registry.h"
+#include "smp.h"
+#include "syscall.h"
+
+/***************************************
+ * Static Function Prototypes
+ ***************************************/
+static inline thread_t * sem_waiter(list_node_t *node);
+
+static void sem_queue(semaphore_t *sem, thread_t *thread);
+
+static void sem_own(semaphore_t *sem, thread_t *thread);
+
+static int32_t sem_effective_pri(thread_t *thread);
+
+static void sem_set_pri(thread_t *thread, int32_t pri);
+
+static void sem_lend(semaphore_t *sem);
+
+/* init_semaphore() - prepares a free semaphore
+ *
+ * A counting semaphore starts with count units, a mutex always with one
+ */
+void init_semaphore(semaphore_t *sem, uint32_t type, int32_t count) {
+    memset((uint8_t *) sem, 0, sizeof (semaphore_t));
+    sem->node.type = NT_SEMAPOHORE;
+    sem->type = type;
+    sem->count = (type == SEM_MUTEX) ? 1 : count;
+    new_list((list_head_t *) &sem->waiters);
+}
+
+/* create_semaphore() - allocates a semaphore, found by name unless name
+ * is NULL. Only the semaphores created here may be passed to the
+ * system calls, the ones prepared with init_semaphore() stay in the kernel
+ */
+semaphore_t * create_semaphore(const char *name, uint32_t type, int32_t count) {
+    semaphore_t * sem = (semaphore_t *) kmalloc(sizeof (semaphore_t));
+
+    init_semaphore(sem, type, count);
+    if (name) {
+        sem->node.name = (char *) kmalloc(strlen((char *) name) + 1);
+        strcpy(sem->node.name, (char *) name);
+    }
+    add_named((list_head_t *) &sys_base->semaphore_list, (list_node_t *) sem);
+    return sem;
+}
+
+/* sem_valid() - tells if a handle is a semaphore from create_semaphore()
+ *
+ * The registry is searched by address, so a semaphore forged in user
+ * memory is never followed.
+ */
+int sem_valid(semaphore_t *sem) {
+    return name_registered((list_node_t *) sem, NT_SEMAPOHORE);
+}
+
+/* find_semaphore() - finds a public semaphore by name */
+semaphore_t * find_semaphore(char *name) {
+    return (semaphore_t *) name_lookup(name, NT_SEMAPOHORE);
+}
+
+/* system call wrapper to obtain a semaphore, waiting for it if needed */
+void obtain_semaphore(semaphore_t *sem) {
+    do_syscall(SYS_OBTAIN, (uint32_t) sem, 0, 0);
+}
+
+/* system call wrapper to obtain a semaphore without waiting.
+   Returns 0 if it was obtained, -1 otherwise */
+int attempt_semaphore(semaphore_t *sem) {
+    return (int) do_syscall(SYS_ATTEMPT, (uint32_t) sem, 0, 0);
+}
+
+/* system call wrapper to release a semaphore */
+void release_semaphore(semaphore_t *sem) {
+    do_syscall(SYS_RELEASE, (uint32_t) sem, 0, 0);
+}
+
+/* _obtain_semaphore() - obtains a unit, or blocks the running thread
+ *
+ * A blocked thread lends its priority to the mutex owner
+ */
+void _obtain_semaphore(semaphore_t *sem) {
+    thread_t * thread = this_cpu()->running_thread;
+
+    if (_attempt_semaphore(sem) == 0)
+        return;
+
+    thread->sem_blocked = sem;
+    sem_queue(sem, thread);
+    sem_lend(sem);
+    _wait_for_flags(ST_SEMAPHORE);
+}
+
+/* _attempt_semaphore() - obtains a unit if one is left
+ *
+ * Returns 0 if it was obtained, -1 otherwise
+ */
+int _attempt_semaphore(semaphore_t *sem) {
+    thread_t * thread = this_cpu()->running_thread;
+
+    // The owner of a mutex may nest its obtains
+    if (sem->type == SEM_MUTEX && sem->owner == thread) {
+        sem->nest++;
+        return 0;
+    }
+    if (sem->count <= 0)
+        return -1;
+    sem->count--;
+    if (sem->type == SEM_MUTEX)
+        sem_own(sem, thread);
+    return 0;
+}
+
+/* _release_semaphore() - gives a unit back, or to the first waiter
+ *
+ * Returns -1 if the running thread does not own the mutex
+ */
+int _release_semaphore(semaphore_t *sem) {
+    thread_t * thread = this_cpu()->running_thread, * next;
+    list_node_t * node;
+
+    if (sem->type == SEM_MUTEX) {
+        if (sem->owner != thread)
+            return -1;
+        if (--sem->nest)
+            return 0;
+        remove(&sem->held_node);
+        sem->owner = NULL;
+        // Drop what the waiters of this mutex lent
+        set_priority(thread, sem_effective_pri(thread));
+    }
+
+    if (!(node = remove_head((list_head_t *) &sem->waiters))) {
+        sem->count++;
+        return 0;
+    }
+    // Hand the unit over, the waiter returns with it
+    next = sem_waiter(node);
+    next->sem_blocked = NULL;
+    if (sem->type == SEM_MUTEX)
+        sem_own(sem, next);
+    _signal(next, ST_SEMAPHORE);
+    return 0;
+}
+
+/* sem_waiter() - thread a waiters node belongs to */
+static inline thread_t * sem_waiter(list_node_t *node) {
+    return (thread_t *) ((uint8_t *) node - offsetof(thread_t, sem_node));
+}
+
+/* sem_queue() - queues a waiter behind the ones of the same priority */
+static void sem_queue(semaphore_t *sem, thread_t *thread) {
+    list_node_t * next;
+
+    thread->sem_node.pri = thread->node.pri;
+    for (next = get_head((list_head_t *) &sem->waiters); next; next = get_next(next))
+        if (thread->sem_node.pri > next->pri) {
+            thread->sem_node.next = next;
+            thread->sem_node.prev = next->prev;
+            next->prev->next = &thread->sem_node;
+            next->prev = &thread->sem_node;
+            return;
+        }
+    add_tail((list_head_t *) &sem->waiters, &thread->sem_node);
+}
+
+/* sem_own() - makes a thread the owner of a mutex */
+static void sem_own(semaphore_t *sem, thread_t *thread) {
+    sem->owner = thread;
+    sem->nest = 1;
+    add_tail((list_head_t *) &thread->sem_held, &sem->held_node);
+    // The remaining waiters lend their priority to the new owner
+    sem_set_pri(thread, sem_effective_pri(thread));
+}
+
+/* sem_effective_pri() - priority a thread runs at, given what it holds */
+static int32_t sem_effective_pri(thread_t *thread) {
+    int32_t pri = thread->base_pri;
+    list_node_t * node, * waiter;
+    semaphore_t * sem;
+
+    for (node = get_head((list_head_t *) &thread->sem_held); node; node = get_next(node)) {
+        sem = (semaphore_t *) ((uint8_t *) node - offsetof(semaphore_t, held_node));
+        // The waiters are sorted, the first one has the highest priority
+        waiter = get_head((list_head_t *) &sem->waiters);
+        if (waiter && waiter->pri > pri)
+            pri = waiter->pri;
+    }
+    return pri;
+}
+
+/* sem_set_pri() - changes the priority of a thread, also where it waits */
+static void sem_set_pri(thread_t *thread, int32_t pri) {
+    set_priority(thread, pri);
+    if (thread->sem_blocked && thread->sem_node.pri != pri) {
+        remove(&thread->sem_node);
+        sem_queue(thread->sem_blocked, thread);
+    }
+}
+
+/* sem_lend() - passes the priority of the waiters on, along the owners */
+static void sem_lend(semaphore_t *sem) {
+    thread_t * owner;
+    int32_t pri;
+    int depth;
+
+    for (depth = 0; depth < SEM_PI_DEPTH; depth++) {
+        if (!sem || sem->type != SEM_MUTEX || !(owner = sem->owner))
+            return;
+        pri = sem_effective_pri(owner);
+        if (pri == owner->node.pri)
+            return;
+        sem_set_pri(owner, pri);
+        sem = owner->sem_blocked;
+    }
+}
@@ -0,0 +1,63 @@
+/*
+ * File:   semaphore.h
+ * Author: renato
+ *
+ * Amiga-style signal semaphores.
+ *
+ * A counting semaphore hands out count units. A mutex has a single unit,
+ * an owner that may obtain it again (it has to be released as many
+ * times), and lends its priority: the owner runs at least at the priority
+ * of its highest waiter, so a low priority holder cannot stall a driver
+ * thread waiting for it.
+ *
+ * Waiters block through the wait()/_signal() path, queued by priority.
+ * A release hands the unit straight to the first waiter, so a woken
+ * thread never has to race for it again. Semaphores are only touched by
+ * system calls, under the kernel lock.
+ */
+
+#ifndef _SEMAPHORE_H
+#define	_SEMAPHORE_H
+
+#include "common.h"
+#include "thread.h"
+
+#define SEM_COUNTING    0   // Counting semaphore
+#define SEM_MUTEX       1   // Mutex with priority inheritance
+
+#define SEM_PI_DEPTH    8   // Owners a priority is lent through, at most
+
+/*! \brief Signal semaphore structure. */
+struct semaphore_s {
+    list_node_t node;           //!< Links the semaphore in semaphore_list.
+    uint32_t type;              //!< SEM_COUNTING or SEM_MUTEX.
+    int32_t count;              //!< Units left to be obtained.
+    thread_t * owner;           //!< Mutex holder, or NULL.
+    uint32_t nest;              //!< Times the holder obtained the mutex.
+    list_node_t held_node;      //!< Links the mutex in the sem_held of its owner.
+    list_head_t waiters;        //!< Waiting threads, by priority (thread_t.sem_node).
+} __attribute__((packed));
+
+typedef struct semaphore_s semaphore_t;
+
+void init_semaphore(semaphore_t *sem, uint32_t type, int32_t count);
+
+semaphore_t * create_semaphore(const char *name, uint32_t type, int32_t count);
+
+semaphore_t * find_semaphore(char *name);
+
+int sem_valid(semaphore_t *sem);
+
+void obtain_semaphore(semaphore_t *sem);
+
+int attempt_semaphore(semaphore_t *sem);
+
+void release_semaphore(semaphore_t *sem);
+
+void _obtain_semaphore(semaphore_t *sem);
+
+int _attempt_semaphore(semaphore_t *sem);
+
+int _release_semaphore(semaphore_t *sem);
+
+#endif	/* _SEMAPHORE_H */
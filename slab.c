@@ -0,0 +1,190 @@
+/* slab.c - Krypton object cache allocator
+ *
+ * Every cache owns a set of 4kB slab pages, mapped on demand in the
+ * SLAB_START...SLAB_END window. A slab page starts with a header pointing
+ * back to its cache, so kfree() finds the owner of an object by masking
+ * its address. Free objects are kept in a LIFO list, so the most recently
+ * freed (and cache-hot) object is the first one to be handed out again.
+ *
+ * The kmalloc() size classes are plain caches without a constructor.
+ */
+
+#include "slab.h"
+#include "pmm.h"
+#include "sysbase.h"
+#include "common.h"
+#include "panic.h"
+
+/***************************************
+ * Static Function Prototypes
+ ***************************************/
+static void cache_setup(kmem_cache_t *cache, const char *name, uint32_t size,
+        uint32_t align, void (*ctor)(void *));
+
+static inline int slab_class(uint32_t l);
+
+static inline uint32_t slab_first(uint32_t align);
+
+static void slab_grow(kmem_cache_t *cache);
+
+/***************************************
+ * Globals
+ ***************************************/
+static const char *slab_class_names[SLAB_NUM_CLASSES] = {
+    "size-8", "size-16", "size-32", "size-64", "size-128", "size-256", "size-512"
+};
+
+/* slab_init() - size classes bootstrap
+ *
+ * Called by mm_init() once the page allocator is online
+ */
+void slab_init() {
+    int i;
+
+    new_list((list_head_t *) &sys_base->kmem_cache_list);
+    // No slab pages mapped yet
+    sys_base->slab_max = SLAB_START;
+
+    // Every class is aligned to its size, like a power-of-two allocation
+    // is expected to be
+    for (i = 0; i < SLAB_NUM_CLASSES; i++)
+        cache_setup(&sys_base->slab_caches[i], slab_class_names[i],
+                SLAB_MIN_SIZE << i, SLAB_MIN_SIZE << i, NULL);
+}
+
+/* kmem_cache_create() - creates a named cache of size-byte objects
+ *
+ * align must be a power of two; ctor may be NULL. Returns NULL if not
+ * even one aligned object fits in a slab page
+ */
+kmem_cache_t *kmem_cache_create(const char *name, uint32_t size, uint32_t align,
+        void (*ctor)(void *)) {
+    kmem_cache_t *cache;
+
+    if (size == 0 || size > 0x1000 || align > 0x1000 || (align & (align - 1)))
+        return NULL;
+    if (align < SLAB_MIN_ALIGN)
+        align = SLAB_MIN_ALIGN;
+    if (slab_first(align) + ((size + align - 1) & ~(align - 1)) > 0x1000)
+        return NULL;
+
+    cache = (kmem_cache_t *) kmalloc(sizeof (kmem_cache_t));
+    cache_setup(cache, name, size, align, ctor);
+    return cache;
+}
+
+/* kmem_cache_alloc() - takes an object from a cache */
+void *kmem_cache_alloc(kmem_cache_t *cache) {
+    slab_object_t *obj;
+    uint32_t flags = spin_lock_irqsave(&cache->lock);
+
+    if (!cache->free_list)
+        slab_grow(cache);
+    if (!cache->free_list) {
+        spin_unlock_irqrestore(&cache->lock, flags);
+        return NULL;
+    }
+
+    // Pop the hottest object from the free list
+    obj = cache->free_list;
+    cache->free_list = obj->next;
+    cache->free--;
+    cache->in_use++;
+    cache->allocs++;
+    spin_unlock_irqrestore(&cache->lock, flags);
+    return (void *) obj;
+}
+
+/* kmem_cache_free() - gives an object back to its cache */
+void kmem_cache_free(kmem_cache_t *cache, void *p) {
+    slab_object_t *obj = (slab_object_t *) p;
+    uint32_t flags = spin_lock_irqsave(&cache->lock);
+
+    obj->next = cache->free_list;
+    cache->free_list = obj;
+    cache->free++;
+    cache->in_use--;
+    cache->frees++;
+    spin_unlock_irqrestore(&cache->lock, flags);
+}
+
+/* slab_alloc() - allocates l bytes (l <= SLAB_MAX_SIZE) from a size class */
+void *slab_alloc(uint32_t l) {
+    return kmem_cache_alloc(&sys_base->slab_caches[slab_class(l)]);
+}
+
+/* slab_free() - gives an object back to the cache it came from */
+void slab_free(void *p) {
+    slab_page_t *page = (slab_page_t *) ((unsigned long) p & PAGE_MASK);
+
+    kmem_cache_free(page->cache, p);
+}
+
+/* cache_setup() - fills in a cache descriptor and registers it */
+static void cache_setup(kmem_cache_t *cache, const char *name, uint32_t size,
+        uint32_t align, void (*ctor)(void *)) {
+    memset((uint8_t *) cache, 0, sizeof (kmem_cache_t));
+
+    if (align < SLAB_MIN_ALIGN)
+        align = SLAB_MIN_ALIGN;
+    if (size < sizeof (slab_object_t))
+        size = sizeof (slab_object_t);
+
+    cache->node.name = (char *) name;
+    cache->node.type = NT_MEMORY;
+    cache->obj_size = (size + align - 1) & ~(align - 1);
+    cache->align = align;
+    cache->ctor = ctor;
+    spin_init(&cache->lock, NULL);
+    add_tail((list_head_t *) &sys_base->kmem_cache_list, (list_node_t *) cache);
+}
+
+/* slab_class() - index of the smallest class able to hold l bytes */
+static inline int slab_class(uint32_t l) {
+    if (l <= SLAB_MIN_SIZE)
+        return 0;
+    // Position of the highest bit of (l - 1), found with bsr
+    return (32 - __builtin_clz(l - 1)) - SLAB_MIN_SHIFT;
+}
+
+/* slab_first() - offset of the first object in a slab page, past the
+ * header and aligned
+ */
+static inline uint32_t slab_first(uint32_t align) {
+    return (SLAB_HEADER_SIZE + align - 1) & ~(align - 1);
+}
+
+/* slab_grow() - maps a new slab page and carves it into objects
+ *
+ * Called with the cache locked. The slab window is shared by all the
+ * caches, so its end moves under the heap lock.
+ */
+static void slab_grow(kmem_cache_t *cache) {
+    slab_page_t *page;
+    unsigned long first, obj;
+    uint32_t flags = spin_lock_irqsave(&sys_base->heap_lock);
+
+    if (sys_base->slab_max >= SLAB_END)
+        panic("Out of slab space.\n");
+
+    page = (slab_page_t *) sys_base->slab_max;
+    sys_base->slab_max += 0x1000;
+    spin_unlock_irqrestore(&sys_base->heap_lock, flags);
+    mm_map(pm_alloc(), page, PAGE_WRITE | PAGE_USER);
+    page->cache = cache;
+    cache->pages++;
+
+    first = (unsigned long) page + slab_first(cache->align);
+    // Construct the objects in address order...
+    for (obj = first; obj + cache->obj_size <= (unsigned long) page + 0x1000;
+         obj += cache->obj_size)
+        if (cache->ctor)
+            cache->ctor((void *) obj);
+    // ... and push them backwards, so they are handed out in address order
+    while (obj > first) {
+        obj -= cache->obj_size;
+        ((slab_object_t *) obj)->next = cache->free_list;
+        cache->free_list = (slab_object_t *) obj;
+        cache->free++;
+    }
+}
@@ -0,0 +1,75 @@
+/*
+ * File:   slab.h
+ * Author: renato
+ *
+ * Object cache allocator sitting in front of the kernel heap.
+ * Requests up to SLAB_MAX_SIZE bytes are rounded up to a power-of-two
+ * size class, aligned to its size, and served from per-class free lists
+ * in O(1).
+ * Frequently used kernel objects get their own typed cache.
+ */
+
+#ifndef _SLAB_H
+#define	_SLAB_H
+
+#include "common.h"
+#include "spinlock.h"
+
+#define SLAB_START          (unsigned long)     0xE0000000
+#define SLAB_END            (unsigned long)     0xF0000000
+#define SLAB_MIN_SHIFT      3                   // Smallest class is 8 bytes
+#define SLAB_MIN_SIZE       (1 << SLAB_MIN_SHIFT)
+#define SLAB_NUM_CLASSES    7                   // 8, 16, 32 ... 512 bytes
+#define SLAB_MAX_SIZE       (SLAB_MIN_SIZE << (SLAB_NUM_CLASSES - 1))
+#define SLAB_HEADER_SIZE    16                  // Objects start here in a slab page
+#define SLAB_MIN_ALIGN      4
+
+/* Tells if an address was handed out by the slab allocator */
+#define SLAB_OWNS(p) ((unsigned long)(p) >= SLAB_START && \
+                      (unsigned long)(p) < SLAB_END)
+
+/* A free object, linked into its cache free list */
+typedef struct slab_object {
+    struct slab_object *next;
+} slab_object_t;
+
+/*! \brief Object cache descriptor.
+ *
+ * Every cache is linked in sys_base->kmem_cache_list, named by node.name.
+ * The constructor runs once per object, when its slab page is carved.
+ * A freed object keeps its constructed state, except for its first word,
+ * which links the free list.
+ */
+typedef struct kmem_cache {
+    list_node_t node;           //!< Links the cache in the cache list
+    uint32_t obj_size;          //!< Distance between objects, alignment included
+    uint32_t align;             //!< Object alignment (power of two)
+    void (*ctor)(void *);       //!< Object constructor, or NULL
+    slab_object_t *free_list;   //!< LIFO list of free objects
+    uint32_t pages;             //!< Slab pages owned by this cache
+    uint32_t in_use;            //!< Live objects
+    uint32_t free;              //!< Objects sitting in the free list
+    uint32_t allocs;            //!< Total number of allocations served
+    uint32_t frees;             //!< Total number of objects given back
+    spinlock_t lock;            //!< Guards the free list and the counters
+} __attribute__((packed)) kmem_cache_t;
+
+/* Header placed at the start of every slab page */
+typedef struct slab_page {
+    kmem_cache_t *cache;        // Cache the objects in this page belong to
+} __attribute__((packed)) slab_page_t;
+
+void slab_init();
+
+void *slab_alloc(uint32_t l);
+
+void slab_free(void *p);
+
+kmem_cache_t *kmem_cache_create(const char *name, uint32_t size, uint32_t align,
+        void (*ctor)(void *));
+
+void *kmem_cache_alloc(kmem_cache_t *cache);
+
+void kmem_cache_free(kmem_cache_t *cache, void *p);
+
+#endif	/* _SLAB_H */
@@ -0,0 +1,538 @@
+/* smp.c - Krypton multiprocessor bring-up
+ *
+ * The processors are found in the ACPI MADT, or in the MP configuration
+ * table on older firmware. Every application processor (AP) is started
+ * with the INIT-SIPI-SIPI sequence: it runs the trampoline copied at
+ * AP_TRAMPOLINE, switches to protected mode with the paging registers of
+ * the bootstrap processor (BSP) and calls ap_main() on its own stack.
+ *
+ * Each CPU schedules the threads of its own run queue. The BSP keeps the
+ * PIT tick and the timer wheel, the APs take their time slices from the
+ * local APIC timer. A thread made ready for another CPU is handed over
+ * with a reschedule IPI.
+ */
+
+#include "smp.h"
+#include "sysbase.h"
+#include "pmm.h"
+#include "idt.h"
+#include "clock.h"
+#include "timer.h"
+#include "common.h"
+#include "kprintf.h"
+
+/* Local APIC registers */
+#define LAPIC_ID            0x20
+#define LAPIC_TPR           0x80
+#define LAPIC_EOI           0xB0
+#define LAPIC_SVR           0xF0
+#define LAPIC_ICR_LOW       0x300
+#define LAPIC_ICR_HIGH      0x310
+#define LAPIC_LVT_TIMER     0x320
+#define LAPIC_TIMER_INIT    0x380
+#define LAPIC_TIMER_CURR    0x390
+#define LAPIC_TIMER_DIV     0x3E0
+
+#define ICR_INIT            0x4500
+#define ICR_STARTUP         0x4600
+#define ICR_FIXED           0x4000
+#define ICR_PENDING         0x1000
+#define LVT_PERIODIC        0x20000
+#define LVT_MASKED          0x10000
+
+/* Firmware table entries */
+#define MADT_LAPIC          0
+#define MP_PROCESSOR        0
+
+/***************************************
+ * Static Function Prototypes
+ ***************************************/
+static int smp_find_madt();
+
+static int smp_find_mp();
+
+static uint8_t *smp_scan(unsigned long start, unsigned long len, const char *sig, int siglen);
+
+static uint8_t *smp_map(uint32_t phys, uint32_t len);
+
+static void smp_unmap();
+
+static uint8_t smp_checksum(const uint8_t *p, uint32_t len);
+
+static void smp_add_cpu(uint32_t apic_id);
+
+static int smp_boot_ap(cpu_t *cpu);
+
+static void lapic_init(int timer);
+
+static void lapic_ipi(uint32_t apic_id, uint32_t icr);
+
+static void udelay(uint32_t us);
+
+static void lapic_timer_callback(registers_t *regs);
+
+static void reschedule_callback(registers_t *regs);
+
+void ap_main(cpu_t *cpu);
+
+/***************************************
+ * Globals
+ ***************************************/
+cpu_t cpus[MAX_CPUS];
+
+static unsigned long lapic_phys = LAPIC_PHYS;
+/* LAPIC timer count for one tick, calibrated by the BSP */
+static uint32_t lapic_ticks;
+/* Pages mapped in the firmware tables window */
+static uint32_t smp_mapped;
+/* Current TLB shootdown: its number and the address to flush */
+static volatile uint32_t tlb_gen;
+static volatile unsigned long tlb_addr;
+
+extern void *kernelpagedirPtr;
+
+/* The trampoline and the variables patched in its copy (smp_s.asm) */
+extern uint8_t ap_trampoline[], ap_trampoline_end[];
+extern uint8_t ap_cr0[], ap_cr3[], ap_cr4[], ap_stack[], ap_cpu[];
+
+#define TRAMPOLINE_VAR(v) (*(uint32_t *) ((uint8_t *) phys_to_virt(AP_TRAMPOLINE) + \
+                                          ((v) - ap_trampoline)))
+
+#define LAPIC_REG(r) (*(volatile uint32_t *) (LAPIC_VIRTUAL + (r)))
+
+/* smp_init() - finds and starts the application processors
+ *
+ * Called by the BSP, with interrupts disabled, once the timer runs.
+ * frequency is the timer tick rate the APs time slices follow.
+ */
+void smp_init(uint32_t frequency) {
+    cpu_t *cpu;
+    uint32_t i, cr;
+
+    // The boot processor is always there, and owns the kernel
+    sys_base->num_cpus = 1;
+    cpus[0].online = 1;
+    smp_lock();
+
+    register_interrupt_handler(IRQ_LAPIC_TIMER, &lapic_timer_callback);
+    register_interrupt_handler(IRQ_RESCHEDULE, &reschedule_callback);
+
+    // The APs are started and timed through the local APIC and the TSC
+    if (!(cpuid_features() & CPUID_APIC) || !(cpuid_features() & CPUID_TSC))
+        return;
+    /* The BIOS data area, the firmware tables below 1MiB and the
+       trampoline page are reached through the linear physical map,
+       which does not exist without PSE: stay on the boot processor */
+    if (sys_base->phys_map_end < 0x100000)
+        return;
+    if (!smp_find_madt() && !smp_find_mp())
+        return;
+
+    mm_map(lapic_phys, (void *) LAPIC_VIRTUAL, PAGE_WRITE | PAGE_NOCACHE);
+    cpus[0].apic_id = LAPIC_REG(LAPIC_ID) >> 24;
+    lapic_init(0);
+
+    // Count the LAPIC timer over 10ms, divided by 16
+    LAPIC_REG(LAPIC_TIMER_DIV) = 0x3;
+    LAPIC_REG(LAPIC_LVT_TIMER) = LVT_MASKED;
+    LAPIC_REG(LAPIC_TIMER_INIT) = 0xFFFFFFFF;
+    udelay(10000);
+    lapic_ticks = (0xFFFFFFFF - LAPIC_REG(LAPIC_TIMER_CURR)) * 100 / frequency;
+    LAPIC_REG(LAPIC_TIMER_INIT) = 0;
+
+    // Copy the trampoline below 1MiB and give it our paging registers
+    memcpy((uint8_t *) phys_to_virt(AP_TRAMPOLINE), ap_trampoline,
+            ap_trampoline_end - ap_trampoline);
+    asm volatile ("mov %%cr0, %0" : "=r" (cr));
+    TRAMPOLINE_VAR(ap_cr0) = cr;
+    asm volatile ("mov %%cr3, %0" : "=r" (cr));
+    TRAMPOLINE_VAR(ap_cr3) = cr;
+    asm volatile ("mov %%cr4, %0" : "=r" (cr));
+    TRAMPOLINE_VAR(ap_cr4) = cr;
+
+    for (i = 1; i < MAX_CPUS; i++) {
+        cpu = &cpus[i];
+        if (!cpu->id || cpu->apic_id == cpus[0].apic_id)
+            continue;
+        if (smp_boot_ap(cpu))
+            sys_base->num_cpus++;
+        else
+            kprintf("SMP: CPU %u (APIC %u) did not start\n", i, cpu->apic_id);
+    }
+    kprintf("SMP: %u CPUs online\n", sys_base->num_cpus);
+}
+
+/* smp_lock() - takes the kernel lock, unless this CPU holds it already */
+void smp_lock() {
+    cpu_t *cpu = this_cpu();
+
+    if (cpu->kernel_locked)
+        return;
+    // The holder may wait for this CPU to flush its TLB, and this CPU may
+    // have interrupts disabled: do it while waiting
+    spin_lock_poll(&sys_base->kernel_lock, smp_tlb_ack);
+    cpu->kernel_locked = 1;
+}
+
+/* smp_unlock() - gives the kernel lock back
+ *
+ * Also called by the dispatcher, on the way back to ring 3
+ */
+void smp_unlock() {
+    this_cpu()->kernel_locked = 0;
+    spin_unlock(&sys_base->kernel_lock);
+}
+
+/* smp_reschedule() - makes another CPU look at its run queue */
+void smp_reschedule(cpu_t *cpu) {
+    cpu->sys_flags |= NEED_SCHEDULE;
+    if (cpu != this_cpu())
+        lapic_ipi(cpu->apic_id, ICR_FIXED | IRQ_RESCHEDULE);
+}
+
+/* smp_flush_tlb() - drops a kernel mapping from the TLB of the other CPUs
+ *
+ * Called with the kernel lock held, once the mapping is gone and flushed
+ * locally. The mapping may be global, and ring 3 reaches the kernel heap,
+ * so every other online CPU is interrupted, and waited for: the frame
+ * behind the mapping may be handed out as soon as this returns.
+ */
+void smp_flush_tlb(unsigned long addr) {
+    cpu_t *self;
+    uint32_t i, gen;
+
+    // Nothing to do before the APs are started
+    if (sys_base->num_cpus <= 1)
+        return;
+    self = this_cpu();
+    tlb_addr = addr;
+    asm volatile ("" ::: "memory");
+    gen = ++tlb_gen;
+    for (i = 0; i < MAX_CPUS; i++)
+        if (cpus[i].online && &cpus[i] != self)
+            lapic_ipi(cpus[i].apic_id, ICR_FIXED | IRQ_TLB_SHOOTDOWN);
+    for (i = 0; i < MAX_CPUS; i++)
+        if (cpus[i].online && &cpus[i] != self)
+            while (cpus[i].tlb_gen != gen)
+                asm volatile ("pause");
+}
+
+/* smp_tlb_ack() - does the pending TLB shootdown on this CPU, if any */
+void smp_tlb_ack() {
+    cpu_t *cpu = this_cpu();
+    uint32_t gen = tlb_gen;
+
+    if (cpu->tlb_gen == gen)
+        return;
+    asm volatile ("invlpg (%0)" :: "r" (tlb_addr) : "memory");
+    cpu->tlb_gen = gen;
+}
+
+/* smp_tlb_interrupt() - TLB shootdown IPI handler
+ *
+ * Reached through isr_tlb_shootdown (idt_s.asm) without the kernel lock,
+ * which the CPU asking for the shootdown holds.
+ */
+void smp_tlb_interrupt() {
+    smp_tlb_ack();
+    lapic_eoi();
+}
+
+/* smp_least_loaded() - the online CPU with the fewest threads to run,
+ * among the ones in the affinity mask (CPU 0 if there is none)
+ */
+cpu_t * smp_least_loaded(uint32_t affinity) {
+    cpu_t *best = &cpus[0];
+    uint32_t i, load, best_load = 0xFFFFFFFF;
+
+    for (i = 0; i < MAX_CPUS; i++) {
+        if (!cpus[i].online || !(affinity & (1 << i)))
+            continue;
+        load = cpus[i].thread_ready.count;
+        if (cpus[i].running_thread &&
+            (cpus[i].running_thread->thread_flags & TS_RUN))
+            load++;
+        if (load < best_load) {
+            best_load = load;
+            best = &cpus[i];
+        }
+    }
+    return best;
+}
+
+/* smp_steal() - gives an idle CPU a thread queued on a busier one
+ *
+ * The busiest peer gives up the tail of its lowest priority level, which
+ * is the thread that would have waited the longest there. Threads not
+ * allowed on the idle CPU are passed over, and so is a peer's running
+ * thread: it may be queued while the peer still runs on its stack.
+ * Returns 1 if a thread was moved to the run queue of cpu.
+ */
+int smp_steal(cpu_t *cpu) {
+    cpu_t *peer, *busiest = NULL;
+    thread_t *thread;
+    uint32_t i;
+
+    for (i = 0; i < MAX_CPUS; i++) {
+        peer = &cpus[i];
+        if (peer == cpu || !peer->online || !peer->thread_ready.count)
+            continue;
+        if (!busiest || peer->thread_ready.count > busiest->thread_ready.count)
+            busiest = peer;
+    }
+    if (!busiest)
+        return 0;
+
+    thread = rq_steal(&busiest->thread_ready, 1 << cpu->id, busiest->running_thread);
+    if (!thread)
+        return 0;
+    thread->cpu = cpu->id;
+    rq_add(&cpu->thread_ready, thread);
+    cpu->steals++;
+    cpu->migrations++;
+    return 1;
+}
+
+/* smp_migrate() - moves a queued thread to the run queue of another CPU */
+void smp_migrate(thread_t *thread, cpu_t *cpu) {
+    rq_remove(&cpus[thread->cpu].thread_ready, thread);
+    thread->cpu = cpu->id;
+    rq_add(&cpu->thread_ready, thread);
+    cpu->migrations++;
+    smp_reschedule(cpu);
+}
+
+/* set_affinity() - restricts the CPUs a thread may run on
+ *
+ * A thread queued on a CPU that is not allowed any more is moved right
+ * away. A running or waiting one moves when it is readied next. Deadline
+ * threads stay on the CPU they were admitted on.
+ */
+void set_affinity(thread_t *thread, uint32_t affinity) {
+    if (thread->dl.runtime)
+        return;
+    thread->affinity = affinity;
+    if ((affinity & (1 << thread->cpu)) || !(thread->thread_flags & TS_READY) ||
+        thread == cpus[thread->cpu].running_thread)
+        return;
+    smp_migrate(thread, smp_least_loaded(affinity));
+}
+
+/* lapic_eoi() - acknowledges an interrupt delivered by the local APIC */
+void lapic_eoi() {
+    LAPIC_REG(LAPIC_EOI) = 0;
+}
+
+/* ap_main() - first C code run by an application processor */
+void ap_main(cpu_t *cpu) {
+    thread_t *idle = &cpu->idle_thread;
+
+    gdt_install(cpu);
+    idt_reload();
+    lapic_init(1);
+    // Let the BSP go on, it holds the lock while starting the others
+    cpu->online = 1;
+    smp_lock();
+
+    // Until its first thread switch, the CPU runs on its boot stack
+    // as a thread that is never queued
+    idle->node.name = "idle";
+    idle->node.type = NT_THREAD;
+    idle->page_directory = kernelpagedirPtr;
+    idle->cpu = cpu->id;
+    cpu->running_thread = idle;
+    cpu->act_page_directory = kernelpagedirPtr;
+    cpu->ts_curr_count = sys_base->std_ts_quantum;
+    cpu->sys_flags = NEED_TASK_SWITCH;
+    cpu->k_reenter = -1;
+    smp_unlock();
+
+    // The first interrupt lands in switch_threads()
+    for (;;)
+        asm volatile ("sti; hlt");
+}
+
+/* smp_boot_ap() - sends INIT-SIPI-SIPI and waits for the AP to show up */
+static int smp_boot_ap(cpu_t *cpu) {
+    int i;
+
+    cpu->kernel_stack = (uint32_t) kmalloc(0x1000) + 0x1000;
+    TRAMPOLINE_VAR(ap_stack) = cpu->kernel_stack;
+    TRAMPOLINE_VAR(ap_cpu) = (uint32_t) cpu;
+
+    lapic_ipi(cpu->apic_id, ICR_INIT);
+    udelay(10000);
+    for (i = 0; i < 2 && !cpu->online; i++) {
+        lapic_ipi(cpu->apic_id, ICR_STARTUP | (AP_TRAMPOLINE >> 12));
+        udelay(200);
+    }
+    for (i = 0; i < 100 && !cpu->online; i++)
+        udelay(1000);
+    return cpu->online;
+}
+
+/* smp_add_cpu() - records a processor found in the firmware tables */
+static void smp_add_cpu(uint32_t apic_id) {
+    uint32_t i;
+
+    // Slot 0 is the BSP, a free slot has no CPU number yet
+    for (i = 1; i < MAX_CPUS; i++) {
+        if (cpus[i].id && cpus[i].apic_id == apic_id)
+            return;
+        if (!cpus[i].id) {
+            cpus[i].apic_id = apic_id;
+            cpus[i].id = i;
+            return;
+        }
+    }
+}
+
+/* smp_find_madt() - reads the processors from the ACPI MADT */
+static int smp_find_madt() {
+    uint8_t *rsdp, *p, *end;
+    uint32_t rsdt, tables[64], entries, len, i;
+    int found = 0;
+
+    // The RSDP is in the first KiB of the EBDA, or in the BIOS area
+    rsdp = smp_scan(*(uint16_t *) phys_to_virt(0x40E) << 4, 0x400, "RSD PTR ", 8);
+    if (!rsdp)
+        rsdp = smp_scan(0xE0000, 0x20000, "RSD PTR ", 8);
+    if (!rsdp)
+        return 0;
+    rsdt = *(uint32_t *) (rsdp + 16);
+
+    p = smp_map(rsdt, 0x1000);
+    entries = (*(uint32_t *) (p + 4) - 36) / 4;
+    if (entries > 64)
+        entries = 64;
+    memcpy((uint8_t *) tables, p + 36, entries * 4);
+    smp_unmap();
+
+    for (i = 0; i < entries && !found; i++) {
+        p = smp_map(tables[i], 36);
+        len = *(uint32_t *) (p + 4);
+        if (memcmp(p, (uint8_t *) "APIC", 4) == 0 &&
+            len <= (SMP_WINDOW_PAGES - 1) * 0x1000) {
+            p = smp_map(tables[i], len);
+            end = p + len;
+            lapic_phys = *(uint32_t *) (p + 36);
+            // Enabled processor entries, after the MADT header
+            for (p += 44; p < end && p[1]; p += p[1])
+                if (p[0] == MADT_LAPIC && (*(uint32_t *) (p + 4) & 1))
+                    smp_add_cpu(p[3]);
+            found = 1;
+        }
+        smp_unmap();
+    }
+    return found;
+}
+
+/* smp_find_mp() - reads the processors from the MP configuration table */
+static int smp_find_mp() {
+    uint8_t *mpfp, *p;
+    uint32_t count, i;
+
+    mpfp = smp_scan(*(uint16_t *) phys_to_virt(0x40E) << 4, 0x400, "_MP_", 4);
+    if (!mpfp)
+        mpfp = smp_scan(0xF0000, 0x10000, "_MP_", 4);
+    // A default configuration has no table to read
+    if (!mpfp || !*(uint32_t *) (mpfp + 4))
+        return 0;
+
+    p = smp_map(*(uint32_t *) (mpfp + 4), 0x1000);
+    if (memcmp(p, (uint8_t *) "PCMP", 4) != 0) {
+        smp_unmap();
+        return 0;
+    }
+    lapic_phys = *(uint32_t *) (p + 36);
+    count = *(uint16_t *) (p + 34);
+    // Processor entries are 20 bytes long, the others 8
+    for (p += 44, i = 0; i < count; i++) {
+        if (p[0] == MP_PROCESSOR) {
+            if (p[3] & 1)
+                smp_add_cpu(p[1]);
+            p += 20;
+        } else
+            p += 8;
+    }
+    smp_unmap();
+    return 1;
+}
+
+/* smp_scan() - looks for a checksummed signature, on 16 byte boundaries */
+static uint8_t *smp_scan(unsigned long start, unsigned long len, const char *sig, int siglen) {
+    uint8_t *p = (uint8_t *) phys_to_virt(start);
+    uint8_t *end = p + len;
+
+    if (!start)
+        return NULL;
+    for (; p < end; p += 16)
+        if (memcmp(p, (uint8_t *) sig, siglen) == 0 &&
+            smp_checksum(p, siglen == 8 ? 20 : 16) == 0)
+            return p;
+    return NULL;
+}
+
+/* smp_map() - maps firmware memory, which may be above the direct map */
+static uint8_t *smp_map(uint32_t phys, uint32_t len) {
+    uint32_t base = phys & PAGE_MASK;
+
+    smp_unmap();
+    len += phys - base;
+    for (; smp_mapped < SMP_WINDOW_PAGES && smp_mapped * 0x1000 < len; smp_mapped++)
+        mm_map(base + smp_mapped * 0x1000,
+                (void *) (SMP_WINDOW + smp_mapped * 0x1000), 0);
+    return (uint8_t *) SMP_WINDOW + (phys - base);
+}
+
+/* smp_unmap() - clears the firmware tables window */
+static void smp_unmap() {
+    while (smp_mapped)
+        mm_unmap((void *) (SMP_WINDOW + --smp_mapped * 0x1000));
+}
+
+static uint8_t smp_checksum(const uint8_t *p, uint32_t len) {
+    uint8_t sum = 0;
+
+    while (len--)
+        sum += *p++;
+    return sum;
+}
+
+/* lapic_init() - enables the local APIC, and its periodic timer if asked */
+static void lapic_init(int timer) {
+    LAPIC_REG(LAPIC_SVR) = 0x100 | IRQ_SPURIOUS;
+    LAPIC_REG(LAPIC_TPR) = 0;
+    if (timer) {
+        LAPIC_REG(LAPIC_TIMER_DIV) = 0x3;
+        LAPIC_REG(LAPIC_LVT_TIMER) = LVT_PERIODIC | IRQ_LAPIC_TIMER;
+        LAPIC_REG(LAPIC_TIMER_INIT) = lapic_ticks;
+    }
+}
+
+/* lapic_ipi() - sends an inter-processor interrupt and waits for delivery */
+static void lapic_ipi(uint32_t apic_id, uint32_t icr) {
+    LAPIC_REG(LAPIC_ICR_HIGH) = apic_id << 24;
+    LAPIC_REG(LAPIC_ICR_LOW) = icr;
+    while (LAPIC_REG(LAPIC_ICR_LOW) & ICR_PENDING)
+        asm volatile ("pause");
+}
+
+static void udelay(uint32_t us) {
+    uint64_t end = ktime_ns() + (uint64_t) us * 1000;
+
+    while (ktime_ns() < end)
+        asm volatile ("pause");
+}
+
+/* The APs take their time slices from the LAPIC timer */
+static void lapic_timer_callback(registers_t *regs) {
+    (void) regs;
+    timer_slice();
+}
+
+/* Another CPU readied a thread for us, NEED_SCHEDULE is set already */
+static void reschedule_callback(registers_t *regs) {
+    (void) regs;
+    this_cpu()->sys_flags |= NEED_SCHEDULE;
+}
@@ -0,0 +1,107 @@
+/*
+ * File:   smp.h
+ * Author: renato
+ *
+ * Multiprocessor support. Every CPU has a cpu_t with its own scheduling
+ * state, GDT, TSS and run queue. The running CPU finds its own through
+ * the %gs segment, which is based on its cpu_t.
+ *
+ * The kernel itself is still entered by one CPU at a time: the kernel
+ * lock (sys_base->kernel_lock) is taken on the first interrupt level and
+ * dropped on the way back to ring 3, or while the CPU halts. The
+ * allocators, run queues and message ports have their own spinlocks.
+ */
+
+#ifndef _SMP_H
+#define	_SMP_H
+
+#include "common.h"
+#include "cpu.h"
+#include "thread.h"
+#include "spinlock.h"
+#include "syscall.h"
+
+#define MAX_CPUS            8
+#define CPU_SELECTOR        0x30        // GDT entry 6: the cpu_t segment, kernel only
+#define CPU_USER_SELECTOR   0x3B        // GDT entry 7 with RPL 3: read-only view of the cpu_t
+
+#define LAPIC_PHYS          0xFEE00000  // Default local APIC base
+#define LAPIC_VIRTUAL       (unsigned long) 0xFD400000
+#define SMP_WINDOW          (unsigned long) 0xFD800000 // Firmware tables window
+#define SMP_WINDOW_PAGES    16
+#define AP_TRAMPOLINE       0x8000      // Real mode entry of the APs
+
+#define IRQ_LAPIC_TIMER     48
+#define IRQ_RESCHEDULE      49
+#define IRQ_TLB_SHOOTDOWN   50
+#define IRQ_SPURIOUS        63
+
+#define CPU_AFFINITY_ALL    0xFFFFFFFF  // A thread may run on any CPU
+
+/*! \brief Per-CPU structure.
+ *
+ * The first four fields are used by the dispatcher in idt_s.asm:
+ * only append new fields at the end.
+ */
+struct cpu_s {
+    unsigned int sys_flags;          //!< Scheduling attention flags of this CPU.
+    thread_t * running_thread;       //!< Thread running on this CPU.
+    uint32_t k_reenter;              //!< Kernel reentrance level (-1 in ring 3).
+    struct cpu_s * self;             //!< Points to itself, read through %gs.
+    uint32_t kernel_locked;          //!< Set while this CPU holds the kernel lock.
+    uint32_t id;                     //!< Logical CPU number.
+    uint32_t apic_id;                //!< Local APIC id.
+    volatile uint32_t online;        //!< Set once the CPU runs the scheduler.
+    long ts_curr_count;              //!< Ticks left in the time slice.
+    pagedir_t * act_page_directory;  //!< Page directory of the running thread.
+    run_queue_t thread_ready;        //!< Threads ready to run on this CPU.
+    thread_t idle_thread;            //!< Running thread of an AP before its first switch.
+    uint32_t kernel_stack;           //!< Top of the boot stack of the CPU.
+    struct gdt_entry gdt[GDT_ENTRIES];
+    struct gdt_ptr gp;
+    tss_entry_t tss;
+    uint32_t steals;                 //!< Threads taken from busier CPUs.
+    uint32_t migrations;             //!< Threads moved in from other CPUs.
+    uint32_t dl_bw;                  //!< Bandwidth admitted to deadline threads.
+    syscall_stats_t syscalls[NUM_SYSCALLS]; //!< System calls made on this CPU.
+    volatile uint32_t tlb_gen;       //!< Last TLB shootdown done by this CPU.
+} __attribute__((packed));
+
+typedef struct cpu_s cpu_t;
+
+extern cpu_t cpus[MAX_CPUS];
+
+/* Returns the cpu_t of the running CPU */
+static inline cpu_t * this_cpu()
+{
+    cpu_t *cpu;
+
+    asm volatile ("mov %%gs:12, %0" : "=r" (cpu));
+    return cpu;
+}
+
+void smp_init(uint32_t frequency);
+
+void smp_lock();
+
+void smp_unlock();
+
+void smp_reschedule(cpu_t *cpu);
+
+cpu_t * smp_least_loaded(uint32_t affinity);
+
+int smp_steal(cpu_t *cpu);
+
+void smp_migrate(thread_t *thread, cpu_t *cpu);
+
+void set_affinity(thread_t *thread, uint32_t affinity);
+
+void lapic_eoi();
+
+void smp_flush_tlb(unsigned long addr);
+
+void smp_tlb_ack();
+
+void smp_tlb_interrupt();
+
+#endif	/* _SMP_H */
@@ -0,0 +1,71 @@
+;
+; smp_s.asm -- application processor startup trampoline.
+;          smp_init() copies it at AP_TRAMPOLINE (0x8000) and patches the
+;          variables at its end. The SIPI starts the APs here, in real mode,
+;          at 0800:0000.
+
+[extern ap_main]
+
+%define TRAMPOLINE  0x8000
+%define REL(x)      ((x) - ap_trampoline)             ; Offset from CS in real mode
+%define ABS(x)      (TRAMPOLINE + (x) - ap_trampoline) ; Address of the copy
+
+section .text
+[bits 16]
+global ap_trampoline
+ap_trampoline:
+    cli
+    cld
+    mov ax, cs               ; Address the trampoline data through ds
+    mov ds, ax
+    o32 lgdt [REL(ap_gdtr)]  ; Load the flat boot GDT
+    mov eax, cr0
+    or eax, 1                ; Enter protected mode...
+    mov cr0, eax
+    jmp dword 0x08:ABS(ap_pmode) ; ...and reload cs with the flat code segment
+
+[bits 32]
+ap_pmode:
+    mov ax, 0x10             ; Load the flat data segment
+    mov ds, ax
+    mov es, ax
+    mov fs, ax
+    mov gs, ax
+    mov ss, ax
+    mov eax, [ABS(ap_cr4)]   ; PSE, PAE and PGE, as the BSP has them
+    mov cr4, eax
+    mov eax, [ABS(ap_cr3)]   ; The kernel page directory
+    mov cr3, eax
+    mov eax, [ABS(ap_cr0)]   ; Enable paging, we run identity mapped
+    mov cr0, eax
+    mov esp, [ABS(ap_stack)] ; Switch to the boot stack of this AP
+    push dword [ABS(ap_cpu)] ; Pass its cpu_t to ap_main()
+    mov eax, ap_main         ; Jump to the higher half
+    call eax
+.halt:
+    cli                      ; ap_main() never returns
+    hlt
+    jmp .halt
+
+align 8
+ap_gdt:
+    dq 0                     ; Null descriptor
+    dq 0x00CF9A000000FFFF    ; Flat code segment
+    dq 0x00CF92000000FFFF    ; Flat data segment
+ap_gdtr:
+    dw 23
+    dd ABS(ap_gdt)
+
+; Patched by smp_init() before every SIPI
+global ap_cr0
+ap_cr0:     dd 0
+global ap_cr3
+ap_cr3:     dd 0
+global ap_cr4
+ap_cr4:     dd 0
+global ap_stack
+ap_stack:   dd 0
+global ap_cpu
+ap_cpu:     dd 0
+global ap_trampoline_end
+ap_trampoline_end:
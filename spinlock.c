@@ -0,0 +1,237 @@
+/* spinlock.c - Krypton kernel locks
+ *
+ * Ticket spinlocks and reader-writer locks. The atomic operations are
+ * done with inline assembly, as the lock fields may sit unaligned in
+ * the packed kernel structures.
+ */
+
+#include "spinlock.h"
+#include "cpu.h"
+#include "kprintf.h"
+
+/***************************************
+ * Static Function Prototypes
+ ***************************************/
+static inline int rw_cmpxchg(rwlock_t *lock, int32_t old, int32_t new);
+
+#ifdef CONFIG_LOCK_STATS
+static void lock_register(const char *name, int cpu, lock_stats_t *stats);
+
+static void lock_acquired(lock_stats_t *stats, uint32_t spins);
+
+static void lock_released(lock_stats_t *stats);
+
+#define LOCK_ACQUIRED(l, spins) lock_acquired(&(l)->stats, spins)
+#define LOCK_RELEASED(l)        lock_released(&(l)->stats)
+#else
+#define LOCK_ACQUIRED(l, spins)
+#define LOCK_RELEASED(l)
+#endif
+
+/***************************************
+ * Globals
+ ***************************************/
+#ifdef CONFIG_LOCK_STATS
+/* The named locks, for lock_report() */
+static struct {
+    const char *name;
+    int cpu;                    // CPU of a per-CPU lock, or LOCK_NO_CPU
+    lock_stats_t *stats;
+} lock_table[LOCK_TABLE_SIZE];
+static uint32_t lock_table_count;
+#endif
+
+/* spin_init() - prepares a free lock; a named one shows in lock_report() */
+void spin_init(spinlock_t *lock, const char *name) {
+    spin_init_cpu(lock, name, LOCK_NO_CPU);
+}
+
+/* spin_init_cpu() - same, for the copy of a per-CPU lock owned by cpu,
+ * which lock_report() tells apart from the others by that number
+ */
+void spin_init_cpu(spinlock_t *lock, const char *name, int cpu) {
+    memset((uint8_t *) lock, 0, sizeof (spinlock_t));
+    lock->name = name;
+#ifdef CONFIG_LOCK_STATS
+    if (name)
+        lock_register(name, cpu, &lock->stats);
+#else
+    (void) cpu;
+#endif
+}
+
+/* spin_lock() - takes a ticket and waits for it to be served */
+void spin_lock(spinlock_t *lock) {
+    spin_lock_poll(lock, NULL);
+}
+
+/* spin_lock_poll() - same, calling poll() (if not NULL) while it waits,
+ * for the requests the holder may be waiting on from this CPU
+ */
+void spin_lock_poll(spinlock_t *lock, void (*poll)(void)) {
+    uint16_t ticket = 1;
+    uint32_t spins = 0;
+
+    asm volatile ("lock xaddw %0, %1" : "+r" (ticket), "+m" (lock->next) :: "memory");
+    while (lock->owner != ticket) {
+        if (poll)
+            poll();
+        asm volatile ("pause");
+        spins++;
+    }
+    LOCK_ACQUIRED(lock, spins);
+}
+
+/* spin_trylock() - takes the lock if it is free. Returns 1 if it was */
+int spin_trylock(spinlock_t *lock) {
+    uint16_t owner = lock->owner, ticket = owner;
+
+    if (lock->next != owner)
+        return 0;
+    // Take the next ticket, unless somebody else took it meanwhile
+    asm volatile ("lock cmpxchgw %2, %1" : "+a" (ticket), "+m" (lock->next)
+            : "r" ((uint16_t) (owner + 1)) : "memory");
+    if (ticket != owner)
+        return 0;
+    LOCK_ACQUIRED(lock, 0);
+    return 1;
+}
+
+/* spin_unlock() - serves the next ticket */
+void spin_unlock(spinlock_t *lock) {
+    LOCK_RELEASED(lock);
+    // Only the holder writes owner, a plain store releases the lock
+    asm volatile ("" ::: "memory");
+    lock->owner++;
+}
+
+/* spin_lock_irqsave() - takes the lock with the local interrupts disabled
+ *
+ * Returns the flags to be given to spin_unlock_irqrestore()
+ */
+uint32_t spin_lock_irqsave(spinlock_t *lock) {
+    uint32_t flags;
+
+    asm volatile ("pushf; pop %0; cli" : "=r" (flags) :: "memory");
+    spin_lock(lock);
+    return flags;
+}
+
+/* spin_unlock_irqrestore() - releases the lock, then restores the interrupts */
+void spin_unlock_irqrestore(spinlock_t *lock, uint32_t flags) {
+    spin_unlock(lock);
+    if (flags & 0x200)
+        asm volatile ("sti" ::: "memory");
+}
+
+/* rw_init() - prepares a free reader-writer lock */
+void rw_init(rwlock_t *lock, const char *name) {
+    memset((uint8_t *) lock, 0, sizeof (rwlock_t));
+    lock->name = name;
+#ifdef CONFIG_LOCK_STATS
+    if (name)
+        lock_register(name, LOCK_NO_CPU, &lock->stats);
+#endif
+}
+
+/* read_lock() - enters as a reader, once no writer is inside */
+void read_lock(rwlock_t *lock) {
+    int32_t count;
+    uint32_t spins = 0;
+
+    for (;;) {
+        count = lock->count;
+        if (count >= 0 && rw_cmpxchg(lock, count, count + 1))
+            break;
+        asm volatile ("pause");
+        spins++;
+    }
+#ifdef CONFIG_LOCK_STATS
+    // Readers overlap, so only their waits are accounted
+    lock->stats.acquisitions++;
+    if (spins) {
+        lock->stats.contended++;
+        lock->stats.spins += spins;
+    }
+#endif
+}
+
+void read_unlock(rwlock_t *lock) {
+    asm volatile ("lock decl %0" : "+m" (lock->count) :: "memory");
+}
+
+/* write_lock() - enters as the only writer, once the lock is empty */
+void write_lock(rwlock_t *lock) {
+    uint32_t spins = 0;
+
+    while (!rw_cmpxchg(lock, 0, -1)) {
+        asm volatile ("pause");
+        spins++;
+    }
+    LOCK_ACQUIRED(lock, spins);
+}
+
+void write_unlock(rwlock_t *lock) {
+    LOCK_RELEASED(lock);
+    asm volatile ("" ::: "memory");
+    lock->count = 0;
+}
+
+/* lock_report() - prints the statistics of the named locks */
+void lock_report() {
+#ifdef CONFIG_LOCK_STATS
+    lock_stats_t *s;
+    uint32_t i;
+
+    kprintf("Lock statistics (acquired/contended/spins/avg hold/max hold):\n");
+    for (i = 0; i < lock_table_count; i++) {
+        s = lock_table[i].stats;
+        kprintf("  %s", lock_table[i].name);
+        if (lock_table[i].cpu != LOCK_NO_CPU)
+            kprintf(" (cpu %d)", lock_table[i].cpu);
+        kprintf(": %u/%u/%u/%u/%u\n", s->acquisitions,
+                s->contended, s->spins,
+                s->acquisitions ? (uint32_t) (s->hold_cycles / s->acquisitions) : 0,
+                s->max_hold);
+    }
+#endif
+}
+
+/* rw_cmpxchg() - sets the count to new if it is old. Returns 1 if it was */
+static inline int rw_cmpxchg(rwlock_t *lock, int32_t old, int32_t new) {
+    int32_t expected = old;
+
+    asm volatile ("lock cmpxchgl %2, %1" : "+a" (old), "+m" (lock->count)
+            : "r" (new) : "memory");
+    return old == expected;
+}
+
+#ifdef CONFIG_LOCK_STATS
+static void lock_register(const char *name, int cpu, lock_stats_t *stats) {
+    if (lock_table_count == LOCK_TABLE_SIZE) {
+        kprintf("Lock table full, lock_report() leaves out %s.\n", name);
+        return;
+    }
+    lock_table[lock_table_count].name = name;
+    lock_table[lock_table_count].cpu = cpu;
+    lock_table[lock_table_count].stats = stats;
+    lock_table_count++;
+}
+
+static void lock_acquired(lock_stats_t *stats, uint32_t spins) {
+    stats->acquisitions++;
+    if (spins) {
+        stats->contended++;
+        stats->spins += spins;
+    }
+    stats->acquired = read_tsc();
+}
+
+static void lock_released(lock_stats_t *stats) {
+    uint32_t held = (uint32_t) (read_tsc() - stats->acquired);
+
+    stats->hold_cycles += held;
+    if (held > stats->max_hold)
+        stats->max_hold = held;
+}
+#endif
@@ -0,0 +1,90 @@
+/*
+ * File:   spinlock.h
+ * Author: renato
+ *
+ * Kernel locks for multiprocessor mutual exclusion.
+ *
+ * Spinlocks are ticket locks: every CPU takes a ticket and spins until it
+ * is served, so the lock is handed out in FIFO order. The _irqsave
+ * variants also disable the interrupts on the local CPU, for data shared
+ * with interrupt handlers. Reader-writer locks let many readers in, or a
+ * single writer.
+ *
+ * Building with CONFIG_LOCK_STATS (make LOCKSTAT=1) counts the
+ * acquisitions, the contended ones, the spins and the hold time of
+ * every lock. Named locks are printed by lock_report().
+ */
+
+#ifndef _SPINLOCK_H
+#define	_SPINLOCK_H
+
+#include "common.h"
+
+#define LOCK_TABLE_SIZE 32  // Named locks lock_report() can list
+#define LOCK_NO_CPU     -1  // The lock is not one of a set of per-CPU locks
+
+/* Contention statistics of a lock */
+typedef struct lock_stats {
+    uint32_t acquisitions;      // Times the lock was taken
+    uint32_t contended;         // Times it had to be waited for
+    uint32_t spins;             // Wait loop iterations, over all waits
+    uint64_t hold_cycles;       // TSC cycles the lock was held, in total
+    uint32_t max_hold;          // Longest hold, in TSC cycles
+    uint64_t acquired;          // When the current holder took it
+} __attribute__((packed)) lock_stats_t;
+
+/*! \brief Ticket spinlock.
+ *
+ * next is the ticket handed to the next CPU, owner the ticket served.
+ * The lock is free when both are equal.
+ */
+typedef struct spinlock {
+    volatile uint16_t next;     //!< Next ticket to take.
+    volatile uint16_t owner;    //!< Ticket holding the lock.
+    const char *name;           //!< Name in lock_report(), or NULL.
+#ifdef CONFIG_LOCK_STATS
+    lock_stats_t stats;
+#endif
+} __attribute__((packed)) spinlock_t;
+
+/*! \brief Reader-writer lock.
+ *
+ * count is the number of readers inside, or -1 while a writer is.
+ */
+typedef struct rwlock {
+    volatile int32_t count;     //!< Readers inside, -1 for a writer.
+    const char *name;           //!< Name in lock_report(), or NULL.
+#ifdef CONFIG_LOCK_STATS
+    lock_stats_t stats;
+#endif
+} __attribute__((packed)) rwlock_t;
+
+void spin_init(spinlock_t *lock, const char *name);
+
+void spin_init_cpu(spinlock_t *lock, const char *name, int cpu);
+
+void spin_lock(spinlock_t *lock);
+
+void spin_lock_poll(spinlock_t *lock, void (*poll)(void));
+
+int spin_trylock(spinlock_t *lock);
+
+void spin_unlock(spinlock_t *lock);
+
+uint32_t spin_lock_irqsave(spinlock_t *lock);
+
+void spin_unlock_irqrestore(spinlock_t *lock, uint32_t flags);
+
+void rw_init(rwlock_t *lock, const char *name);
+
+void read_lock(rwlock_t *lock);
+
+void read_unlock(rwlock_t *lock);
+
+void write_lock(rwlock_t *lock);
+
+void write_unlock(rwlock_t *lock);
+
+void lock_report();
+
+#endif	/* _SPINLOCK_H */
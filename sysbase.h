@@ -3,6 +3,7 @@
  * Author: renato
  *
  *  This file contains the sys_base_t structure definition
+ *  The scheduling state of every processor is in its cpu_t (smp.h)
  *
  *
  * Created on November 15, 2013, 6:27 PM
@@ -14,35 +15,60 @@
 #include "pmm.h"
 #include "common.h"
 #include "thread.h"
+#include "slab.h"
+#include "vmm.h"
+#include "registry.h"
+#include "timer.h"
+#include "smp.h"
+#include "spinlock.h"
 
 #define NEED_SCHEDULE 1
 #define TIME_SLICE_EXPIRED 2
 #define NEED_TASK_SWITCH 4
 
 struct sys_base_t {
-    unsigned int sys_flags;
-    thread_t * running_thread;
-    uint32_t k_reenter;
+    spinlock_t kernel_lock; // Held by the CPU running in the kernel
+    spinlock_t pm_lock; // Frame allocator
+    spinlock_t heap_lock; // Kernel heap and slab window
     unsigned int vm_online;
     unsigned int pm_last_page; // Address of the last never-freed page given
-    unsigned long * mm_free_page_stack_ptr; // Free page stack address
-    unsigned long mm_free_page_stack_max;  // Maximum free page stack address
+    pm_frame_t * pm_frames; // Physical frame descriptors
+    unsigned long pm_max_frame; // Number of frame descriptors
+    pm_free_area_t pm_free_area[PM_MAX_ORDER + 1]; // Free buddy blocks per order
+    pm_region_t pm_regions[PM_MAX_REGIONS]; // Usable RAM, sorted by address
+    unsigned long pm_num_regions;
+    unsigned long pm_next_chunk; // Next 4MiB chunk to be carved
+    unsigned long pm_num_chunks;
     unsigned long free_pages; // Number of free pages
-    heap_header_t * sh_heap; // Public heap address
-    unsigned long sh_heap_max;
+    heap_header_t * sh_heap_bins[HEAP_NUM_BINS]; // Free chunks, segregated by size
+    uint32_t sh_heap_bin_map; // Bit n set if sh_heap_bins[n] is not empty
+    unsigned long sh_heap_top; // End of the last heap chunk
+    unsigned long sh_heap_max; // End of the mapped heap pages
+    unsigned long phys_map_end; // Physical memory below this is linearly mapped
+    kmem_cache_t slab_caches[SLAB_NUM_CLASSES]; // Small object size classes
+    unsigned long slab_max; // End of the mapped slab pages
+    list_head_t kmem_cache_list; // Every object cache, by name
+    kmem_cache_t * thread_cache; // Thread descriptors
+    vm_space_t kernel_space; // Boot address space, owns the kernel half areas
+    list_head_t vm_space_list; // Every address space
+    uint32_t vm_stack_map[VM_STACK_SLOTS / 32]; // Thread stack slots in use
+    name_entry_t * name_hash[NAME_HASH_SIZE]; // Named nodes, by name and type
+    name_entry_t * addr_hash[NAME_HASH_SIZE]; // Registered nodes, by address
     list_head_t resources_list;
     list_head_t device_list;
     list_head_t lib_list;
     list_head_t msgport_list;
-    list_head_t thread_ready;
     list_head_t thread_wait;
+    timer_wheel_t timer_wheel; // Armed timers, by expiry
     list_head_t intr_list;
     list_head_t semaphore_list;
     unsigned long std_ts_quantum;
-    long ts_curr_count;
     long forbid_counter;
     long disable_counter;
-    pagedir_t * act_page_directory;
+    unsigned long cr3_reload_rate; // CR3 reloads in the last second
+    unsigned long wakeup_rate; // Idle wakeups in the last second
+    unsigned long idle_ticks; // Ticks spent idle
+    unsigned long num_cpus; // Processors online
 }__attribute__((packed));
 
 #endif	/* _SYSBASE_H */
@@ -0,0 +1,396 @@
+/* syscall.c - Krypton system call dispatch
+ *
+ * Both entry points (int 0xFF and sysenter) build the same registers_t
+ * frame and end in syscall_handler(), which looks the call up in the
+ * dispatch table. Every entry takes the three arguments and returns the
+ * value handed back in eax.
+ *
+ * The arguments of a call from ring 3 are checked against the kinds the
+ * entry was registered with, so a handler only gets pointers it may
+ * follow. Calls from ring 0 are trusted.
+ *
+ * The statistics count the cycles from the table lookup to the return
+ * of the handler: a call that blocks is timed until it gave the CPU up,
+ * not until it was woken.
+ */
+
+#include "syscall.h"
+#include "idt.h"
+#include "sysbase.h"
+#include "cpu.h"
+#include "smp.h"
+#include "thread.h"
+#include "message.h"
+#include "monitor.h"
+#include "semaphore.h"
+#include "deadline.h"
+#include "kprintf.h"
+#include "vmm.h"
+#include "registry.h"
+#include "ring.h"
+
+/***************************************
+ * Static Function Prototypes
+ ***************************************/
+static void syscall_handler(registers_t *regs);
+
+static uint32_t syscall_check(const syscall_desc_t *desc, registers_t *regs);
+
+static uint32_t syscall_check_arg(const syscall_desc_t *desc, uint8_t kind,
+        uint32_t arg, uint32_t next);
+
+static void syscall_account(syscall_stats_t *stats, uint32_t cycles);
+
+static uint32_t sys_wait(uint32_t flags, uint32_t unused1, uint32_t unused2);
+
+static uint32_t sys_write(uint32_t str, uint32_t unused1, uint32_t unused2);
+
+static uint32_t sys_msg_retrieve(uint32_t msg_ptr, uint32_t unused1, uint32_t unused2);
+
+static uint32_t sys_msg_cycle(uint32_t unused0, uint32_t unused1, uint32_t unused2);
+
+static uint32_t sys_sleep(uint32_t ticks, uint32_t unused1, uint32_t unused2);
+
+static uint32_t sys_wait_timeout(uint32_t flags, uint32_t ticks, uint32_t unused2);
+
+static uint32_t sys_obtain(uint32_t sem, uint32_t unused1, uint32_t unused2);
+
+static uint32_t sys_attempt(uint32_t sem, uint32_t unused1, uint32_t unused2);
+
+static uint32_t sys_release(uint32_t sem, uint32_t unused1, uint32_t unused2);
+
+static uint32_t sys_set_deadline(uint32_t runtime, uint32_t deadline, uint32_t period);
+
+static uint32_t sys_null(uint32_t unused0, uint32_t unused1, uint32_t unused2);
+
+static uint32_t sys_stats(uint32_t num, uint32_t info, uint32_t unused2);
+
+static uint32_t sys_ring_setup(uint32_t flags, uint32_t unused1, uint32_t unused2);
+
+static uint32_t sys_ring_enter(uint32_t unused0, uint32_t unused1, uint32_t unused2);
+
+static uint32_t sys_msg_post(uint32_t thread, uint32_t buf, uint32_t size);
+
+static uint32_t sys_msg_try_post(uint32_t thread, uint32_t buf, uint32_t size);
+
+/***************************************
+ * Globals
+ ***************************************/
+uint32_t syscall_sysenter = 0;
+
+static syscall_desc_t syscall_table[NUM_SYSCALLS];
+
+/* syscall_init() - registers the kernel system calls and installs the
+ * int 0xFF handler
+ *
+ * The processors load their sysenter MSRs with their GDT, the user side
+ * starts using sysenter here
+ */
+void syscall_init() {
+    syscall_register(SYS_WAIT, "wait", sys_wait, SA_INT, SA_NONE, SA_NONE, 0, 0);
+    syscall_register(SYS_WRITE, "write", sys_write, SA_STR, SA_NONE, SA_NONE, 0, 0);
+    syscall_register(SYS_MSG_RETRIEVE, "msg_retrieve", sys_msg_retrieve,
+            SA_PTR_OUT, SA_NONE, SA_NONE, sizeof (message_t *), 0);
+    syscall_register(SYS_MSG_CYCLE, "msg_cycle", sys_msg_cycle,
+            SA_NONE, SA_NONE, SA_NONE, 0, 0);
+    syscall_register(SYS_SLEEP, "sleep", sys_sleep, SA_INT, SA_NONE, SA_NONE, 0, 0);
+    syscall_register(SYS_WAIT_TIMEOUT, "wait_timeout", sys_wait_timeout,
+            SA_INT, SA_INT, SA_NONE, 0, 0);
+    syscall_register(SYS_OBTAIN, "obtain_sem", sys_obtain, SA_SEM, SA_NONE, SA_NONE, 0, 0);
+    syscall_register(SYS_ATTEMPT, "attempt_sem", sys_attempt, SA_SEM, SA_NONE, SA_NONE, 0, 0);
+    syscall_register(SYS_RELEASE, "release_sem", sys_release, SA_SEM, SA_NONE, SA_NONE, 0, 0);
+    // Real-time bandwidth is only handed out to the system threads
+    syscall_register(SYS_SET_DEADLINE, "set_deadline", sys_set_deadline,
+            SA_INT, SA_INT, SA_INT, 0, SC_PRIV);
+    syscall_register(SYS_NULL, "null", sys_null, SA_NONE, SA_NONE, SA_NONE, 0, 0);
+    syscall_register(SYS_STATS, "stats", sys_stats,
+            SA_INT, SA_PTR_OUT, SA_NONE, sizeof (syscall_info_t), 0);
+    syscall_register(SYS_RING_SETUP, "ring_setup", sys_ring_setup,
+            SA_INT, SA_NONE, SA_NONE, 0, 0);
+    syscall_register(SYS_RING_ENTER, "ring_enter", sys_ring_enter,
+            SA_NONE, SA_NONE, SA_NONE, 0, 0);
+    syscall_register(SYS_MSG_POST, "msg_post", sys_msg_post,
+            SA_THREAD, SA_BUF, SA_INT, MAX_MSG_SZ, 0);
+    syscall_register(SYS_MSG_TRY_POST, "msg_try_post", sys_msg_try_post,
+            SA_THREAD, SA_BUF, SA_INT, MAX_MSG_SZ, 0);
+
+    register_interrupt_handler(255, &syscall_handler);
+    syscall_sysenter = sysenter_supported();
+}
+
+/* syscall_register() - adds a call to the dispatch table
+ *
+ * arg1...arg3 are the SA_* kinds of the arguments, size the bytes behind
+ * the pointer ones. Returns 0, or -1 if the number is out of the table or
+ * already taken.
+ */
+int syscall_register(uint32_t num, const char *name, syscall_t handler,
+        uint8_t arg1, uint8_t arg2, uint8_t arg3, uint32_t size, uint8_t flags) {
+    syscall_desc_t * desc;
+
+    if (num >= NUM_SYSCALLS || syscall_table[num].handler)
+        return -1;
+    desc = &syscall_table[num];
+    desc->name = name;
+    desc->args[0] = arg1;
+    desc->args[1] = arg2;
+    desc->args[2] = arg3;
+    desc->size = size;
+    desc->flags = flags;
+    desc->handler = handler;
+    return 0;
+}
+
+/* system call wrapper to read the statistics of a system call, summed
+   over the CPUs. Returns 0, or -1 if there is no such call */
+int syscall_stats(uint32_t num, syscall_info_t *info) {
+    return do_syscall(SYS_STATS, num, (uint32_t) info, 0) ? -1 : 0;
+}
+
+/* syscall_bench() - prints the cycles a null system call takes
+ *
+ * Called from ring 3, with both entry points
+ */
+void syscall_bench() {
+    uint64_t start;
+    uint32_t i;
+
+    // Warm the caches up first
+    syscall_int(SYS_NULL, 0, 0, 0);
+    start = read_tsc();
+    for (i = 0; i < SYSCALL_BENCH_LOOPS; i++)
+        syscall_int(SYS_NULL, 0, 0, 0);
+    kprintf("Null system call (cycles): int 0xFF %u",
+            (uint32_t) ((read_tsc() - start) / SYSCALL_BENCH_LOOPS));
+
+    if (syscall_sysenter) {
+        syscall_fast(SYS_NULL, 0, 0, 0);
+        start = read_tsc();
+        for (i = 0; i < SYSCALL_BENCH_LOOPS; i++)
+            syscall_fast(SYS_NULL, 0, 0, 0);
+        kprintf(", sysenter %u",
+                (uint32_t) ((read_tsc() - start) / SYSCALL_BENCH_LOOPS));
+    }
+    kprintf("\n");
+}
+
+/* syscall_report() - prints the statistics of the calls made so far
+ *
+ * A user tool: it only goes through syscall_stats(). The histogram shows
+ * the calls of every non-empty log2 bucket, as bucket:calls.
+ */
+void syscall_report() {
+    syscall_info_t info;
+    uint32_t num, i;
+
+    kprintf("System calls (calls/errors/avg cycles, log2 cycles:calls):\n");
+    for (num = 0; num < NUM_SYSCALLS; num++) {
+        if (syscall_stats(num, &info) || !info.stats.calls)
+            continue;
+        kprintf("  %s: %u/%u/%u ", info.name, info.stats.calls, info.stats.errors,
+                (uint32_t) (info.stats.cycles / info.stats.calls));
+        for (i = 0; i < SYSCALL_HIST_BUCKETS; i++)
+            if (info.stats.hist[i])
+                kprintf(" %u:%u", i, info.stats.hist[i]);
+        kprintf("\n");
+    }
+}
+
+/* syscall_handler() - runs a system call, for both entry points */
+static void syscall_handler(registers_t *regs) {
+    const syscall_desc_t * desc;
+    syscall_stats_t * stats;
+    uint64_t start = read_tsc();
+    uint32_t ret;
+
+    if (regs->eax >= NUM_SYSCALLS || !syscall_table[regs->eax].handler) {
+        regs->eax = SYSCALL_ENOSYS;
+        return;
+    }
+    desc = &syscall_table[regs->eax];
+    stats = &this_cpu()->syscalls[regs->eax];
+
+    if ((ret = syscall_check(desc, regs))) {
+        stats->errors++;
+        regs->eax = ret;
+        return;
+    }
+    regs->eax = desc->handler(regs->ebx, regs->ecx, regs->edx);
+    // Blocking calls leave the kernel on another thread, but on this CPU
+    syscall_account(stats, (uint32_t) (read_tsc() - start));
+}
+
+/* syscall_check() - validates the caller and the arguments of a call
+ *
+ * Returns 0, or the error to hand back
+ */
+static uint32_t syscall_check(const syscall_desc_t *desc, registers_t *regs) {
+    uint32_t args[4] = { regs->ebx, regs->ecx, regs->edx, 0 };
+    uint32_t ret;
+    int i;
+
+    // The kernel calls itself with its own arguments
+    if ((regs->cs & 3) == 0)
+        return 0;
+    if ((desc->flags & SC_PRIV) && this_cpu()->running_thread->uid != 0)
+        return SYSCALL_EPERM;
+    for (i = 0; i < 3; i++)
+        if ((ret = syscall_check_arg(desc, desc->args[i], args[i], args[i + 1])))
+            return ret;
+    return 0;
+}
+
+/* syscall_check_arg() - checks an argument is fit for its kind. next is
+ * the argument after it, the length of a SA_BUF
+ *
+ * Returns 0, or the error to hand back
+ */
+static uint32_t syscall_check_arg(const syscall_desc_t *desc, uint8_t kind,
+        uint32_t arg, uint32_t next) {
+    switch (kind) {
+        case SA_PTR_IN:
+            return arg && vm_user_access(arg, desc->size, 0) ? 0 : SYSCALL_EFAULT;
+        case SA_PTR_OUT:
+            return arg && vm_user_access(arg, desc->size, 1) ? 0 : SYSCALL_EFAULT;
+        case SA_BUF:
+            if (next > desc->size)
+                return SYSCALL_EINVAL;
+            return !next || (arg && vm_user_access(arg, next, 0)) ? 0 : SYSCALL_EFAULT;
+        case SA_STR:
+            return arg && vm_user_string((const char *) arg, SYSCALL_MAX_STR) ?
+                   0 : SYSCALL_EFAULT;
+        case SA_SEM:
+            // Found by address, a forged one is never followed
+            return arg && sem_valid((semaphore_t *) arg) ? 0 : SYSCALL_EINVAL;
+        case SA_THREAD:
+            return arg && name_registered((list_node_t *) arg, NT_THREAD) ?
+                   0 : SYSCALL_EINVAL;
+        default:
+            return 0;
+    }
+}
+
+/* syscall_account() - adds a call to the statistics of this CPU */
+static void syscall_account(syscall_stats_t *stats, uint32_t cycles) {
+    stats->calls++;
+    stats->cycles += cycles;
+    // The bucket is the position of the highest bit set, found with bsr
+    stats->hist[cycles ? 31 - __builtin_clz(cycles) : 0]++;
+}
+
+static uint32_t sys_wait(uint32_t flags, uint32_t unused1, uint32_t unused2) {
+    (void) unused1;
+    (void) unused2;
+    _wait_for_flags(flags);
+    return 0;
+}
+
+static uint32_t sys_write(uint32_t str, uint32_t unused1, uint32_t unused2) {
+    (void) unused1;
+    (void) unused2;
+    _monitor_write((char *) str);
+    return 0;
+}
+
+static uint32_t sys_msg_retrieve(uint32_t msg_ptr, uint32_t unused1, uint32_t unused2) {
+    (void) unused1;
+    (void) unused2;
+    _msg_retrieve((message_t **) msg_ptr);
+    return 0;
+}
+
+static uint32_t sys_msg_cycle(uint32_t unused0, uint32_t unused1, uint32_t unused2) {
+    (void) unused0;
+    (void) unused1;
+    (void) unused2;
+    _msg_cycle();
+    return 0;
+}
+
+static uint32_t sys_sleep(uint32_t ticks, uint32_t unused1, uint32_t unused2) {
+    (void) unused1;
+    (void) unused2;
+    _wait_timeout(0, ticks);
+    return 0;
+}
+
+static uint32_t sys_wait_timeout(uint32_t flags, uint32_t ticks, uint32_t unused2) {
+    (void) unused2;
+    _wait_timeout(flags, ticks);
+    return 0;
+}
+
+static uint32_t sys_obtain(uint32_t sem, uint32_t unused1, uint32_t unused2) {
+    (void) unused1;
+    (void) unused2;
+    _obtain_semaphore((semaphore_t *) sem);
+    return 0;
+}
+
+static uint32_t sys_attempt(uint32_t sem, uint32_t unused1, uint32_t unused2) {
+    (void) unused1;
+    (void) unused2;
+    return _attempt_semaphore((semaphore_t *) sem);
+}
+
+static uint32_t sys_release(uint32_t sem, uint32_t unused1, uint32_t unused2) {
+    (void) unused1;
+    (void) unused2;
+    return _release_semaphore((semaphore_t *) sem);
+}
+
+static uint32_t sys_set_deadline(uint32_t runtime, uint32_t deadline, uint32_t period) {
+    return _set_deadline(this_cpu()->running_thread, runtime, deadline, period);
+}
+
+static uint32_t sys_null(uint32_t unused0, uint32_t unused1, uint32_t unused2) {
+    (void) unused0;
+    (void) unused1;
+    (void) unused2;
+    return 0;
+}
+
+static uint32_t sys_stats(uint32_t num, uint32_t info, uint32_t unused2) {
+    (void) unused2;
+    syscall_info_t * out = (syscall_info_t *) info;
+    syscall_stats_t * stats;
+    uint32_t i, bucket;
+
+    if (num >= NUM_SYSCALLS || !syscall_table[num].handler)
+        return SYSCALL_EINVAL;
+    memset((uint8_t *) out, 0, sizeof (syscall_info_t));
+    for (i = 0; i < SYSCALL_NAME_LEN - 1 && syscall_table[num].name[i]; i++)
+        out->name[i] = syscall_table[num].name[i];
+    for (i = 0; i < MAX_CPUS; i++) {
+        if (!cpus[i].online)
+            continue;
+        stats = &cpus[i].syscalls[num];
+        out->stats.calls += stats->calls;
+        out->stats.errors += stats->errors;
+        out->stats.cycles += stats->cycles;
+        for (bucket = 0; bucket < SYSCALL_HIST_BUCKETS; bucket++)
+            out->stats.hist[bucket] += stats->hist[bucket];
+    }
+    return 0;
+}
+
+static uint32_t sys_ring_setup(uint32_t flags, uint32_t unused1, uint32_t unused2) {
+    (void) unused1;
+    (void) unused2;
+    return (uint32_t) _ring_setup(this_cpu()->running_thread, flags);
+}
+
+static uint32_t sys_ring_enter(uint32_t unused0, uint32_t unused1, uint32_t unused2) {
+    (void) unused0;
+    (void) unused1;
+    (void) unused2;
+    return _ring_enter(this_cpu()->running_thread);
+}
+
+static uint32_t sys_msg_post(uint32_t thread, uint32_t buf, uint32_t size) {
+    return _msg_post((thread_t *) thread, (uint8_t *) buf, (uint16_t) size);
+}
+
+static uint32_t sys_msg_try_post(uint32_t thread, uint32_t buf, uint32_t size) {
+    return _msg_try_post((thread_t *) thread, (uint8_t *) buf, (uint16_t) size);
+}
@@ -0,0 +1,148 @@
+/*
+ * File:   syscall.h
+ * Author: renato
+ *
+ * System call numbers, and the user side of the system call interface.
+ *
+ * A system call takes its number in eax and up to three arguments, and
+ * returns a value in eax. There are two ways into the kernel:
+ *  - int 0xFF, with the arguments in ebx, ecx and edx. It always works,
+ *    from ring 0 too.
+ *  - sysenter, with the arguments in ebx, esi and edi, as ecx and edx
+ *    carry the user stack and return address for sysexit. It is used
+ *    from ring 3 when the processors have it.
+ * Both paths end in the same dispatch table, with the arguments in the
+ * ebx, ecx and edx of the registers_t.
+ *
+ * Every entry of the table describes its arguments, so pointers coming
+ * from ring 3 are checked before the call runs, and may be restricted to
+ * uid 0. Every CPU counts the calls, the cycles they took in the kernel
+ * and a log2 histogram of those, readable with syscall_stats().
+ */
+
+#ifndef _SYSCALL_H
+#define	_SYSCALL_H
+
+#include "common.h"
+
+#define SYS_WAIT            0   // wait(signals)
+#define SYS_WRITE           1   // monitor_write(string)
+#define SYS_MSG_RETRIEVE    2   // _msg_retrieve(&message)
+#define SYS_MSG_CYCLE       3   // _msg_cycle()
+#define SYS_SLEEP           4   // sleep(ticks)
+#define SYS_WAIT_TIMEOUT    5   // wait_timeout(signals, ticks)
+#define SYS_OBTAIN          6   // obtain_semaphore(semaphore)
+#define SYS_ATTEMPT         7   // attempt_semaphore(semaphore)
+#define SYS_RELEASE         8   // release_semaphore(semaphore)
+#define SYS_SET_DEADLINE    9   // set_deadline(runtime, deadline, period)
+#define SYS_NULL            10  // Does nothing, to time the entry and exit
+#define SYS_STATS           11  // syscall_stats(number, &info)
+#define SYS_RING_SETUP      12  // ring_setup(flags)
+#define SYS_RING_ENTER      13  // ring_enter()
+#define SYS_MSG_POST        14  // msg_post(thread, buffer, size)
+#define SYS_MSG_TRY_POST    15  // msg_try_post(thread, buffer, size)
+#define NUM_SYSCALLS        32  // Room in the table, for syscall_register()
+
+/* Errors returned by the dispatcher, apart from the -1 of some calls */
+#define SYSCALL_ENOSYS      ((uint32_t) -100) // No such system call
+#define SYSCALL_EPERM       ((uint32_t) -101) // Only uid 0 may make it
+#define SYSCALL_EFAULT      ((uint32_t) -102) // Bad pointer argument
+#define SYSCALL_EINVAL      ((uint32_t) -103) // Bad argument
+
+/* Argument kinds, checked before a call from ring 3 runs */
+#define SA_NONE             0   // Not used
+#define SA_INT              1   // Any value
+#define SA_PTR_IN           2   // User memory read by the call (size bytes)
+#define SA_PTR_OUT          3   // User memory written by the call (size bytes)
+#define SA_STR              4   // NUL terminated user string
+#define SA_SEM              5   // Semaphore from create_semaphore()
+#define SA_THREAD           6   // Registered thread
+#define SA_BUF              7   // User memory read by the call, the next argument bytes (size at most)
+
+#define SC_PRIV             1   // Only threads of uid 0 may make the call
+
+#define SYSCALL_MAX_STR     4096 // Longest string argument, NUL included
+#define SYSCALL_NAME_LEN    16
+#define SYSCALL_HIST_BUCKETS 32 // Bucket n counts calls of 2^n...2^(n+1)-1 cycles
+
+typedef uint32_t (*syscall_t)(uint32_t, uint32_t, uint32_t);
+
+/* Dispatch table entry */
+typedef struct syscall_desc {
+    const char *name;           // Name shown by syscall_report()
+    syscall_t handler;          // NULL for a free entry
+    uint8_t args[3];            // SA_* kind of every argument
+    uint8_t flags;              // SC_* flags
+    uint32_t size;              // Bytes behind a SA_PTR_* argument
+} __attribute__((packed)) syscall_desc_t;
+
+/* Statistics of a system call, on one CPU */
+typedef struct syscall_stats {
+    uint32_t calls;             // Calls made
+    uint32_t errors;            // Calls refused by the dispatcher
+    uint64_t cycles;            // TSC cycles spent running them
+    uint32_t hist[SYSCALL_HIST_BUCKETS]; // Calls, by log2 of their cycles
+} __attribute__((packed)) syscall_stats_t;
+
+/* What syscall_stats() returns: the statistics summed over the CPUs */
+typedef struct syscall_info {
+    char name[SYSCALL_NAME_LEN];
+    syscall_stats_t stats;
+} __attribute__((packed)) syscall_info_t;
+
+#define SYSCALL_BENCH_LOOPS 1000 // Calls timed by syscall_bench()
+
+/* Set if every processor is set up for sysenter */
+extern uint32_t syscall_sysenter;
+
+/* Enters the kernel through int 0xFF */
+static inline uint32_t syscall_int(uint32_t num, uint32_t a1, uint32_t a2,
+        uint32_t a3)
+{
+    uint32_t ret;
+
+    asm volatile("int $0xFF" : "=a" (ret)
+                 : "a" (num), "b" (a1), "c" (a2), "d" (a3) : "memory");
+    return ret;
+}
+
+/* Enters the kernel through sysenter, from ring 3 only */
+static inline uint32_t syscall_fast(uint32_t num, uint32_t a1, uint32_t a2,
+        uint32_t a3)
+{
+    uint32_t ret;
+
+    asm volatile("mov %%esp, %%ecx; \
+                  mov $1f, %%edx; \
+                  sysenter; \
+                  1:" : "=a" (ret)
+                 : "a" (num), "b" (a1), "S" (a2), "D" (a3)
+                 : "%ecx", "%edx", "memory", "cc");
+    return ret;
+}
+
+/* Makes a system call the fastest way available. sysexit always returns
+ * to ring 3, so the kernel keeps using int 0xFF */
+static inline uint32_t do_syscall(uint32_t num, uint32_t a1, uint32_t a2,
+        uint32_t a3)
+{
+    uint16_t cs;
+
+    asm volatile("mov %%cs, %0" : "=r" (cs));
+    if (syscall_sysenter && (cs & 3) == 3)
+        return syscall_fast(num, a1, a2, a3);
+    return syscall_int(num, a1, a2, a3);
+}
+
+void syscall_init();
+
+int syscall_register(uint32_t num, const char *name, syscall_t handler,
+        uint8_t arg1, uint8_t arg2, uint8_t arg3, uint32_t size, uint8_t flags);
+
+int syscall_stats(uint32_t num, syscall_info_t *info);
+
+void syscall_bench();
+
+void syscall_report();
+
+#endif	/* _SYSCALL_H */
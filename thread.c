@@ -3,20 +3,68 @@
 #include "pmm.h"
 #include "common.h"
 #include "cpu.h"
+#include "registry.h"
+#include "smp.h"
+#include "deadline.h"
+#include "clock.h"
+#include "syscall.h"
+#include "message.h"
 
 extern void switch_context(thread_t *);
 
+/* thread_ctor() - constructor of the thread_t cache
+ *
+ * Sets up the fields a thread leaves as it found them: empty lists, the
+ * node types and the timeout timer. The first word (node.next) is the
+ * free list link of a free object, and is never relied upon.
+ */
+void thread_ctor(void *obj) {
+    thread_t * thread = (thread_t *) obj;
+
+    memset((uint8_t *) thread, 0, sizeof (thread_t));
+    thread->node.type = NT_THREAD;
+    thread->msg_port.node.type = NT_MSGPORT;
+    new_list((list_head_t *) &thread->sem_held);
+    new_list((list_head_t *) &thread->msg_wait_proc);
+    thread->timer.thread = thread;
+    thread->timer.sig = ST_TIMEOUT;
+}
+
+static void rq_unlink(run_queue_t *rq, thread_t *thread);
+
+static thread_t * rq_first(run_queue_t *rq);
+
+static void rq_insert_dl(list_head_t *list, thread_t *thread);
+
+static int rq_before(thread_t *a, thread_t *b);
+
 
 thread_t *create_thread(int (*fn)(void*), void *args, int (*at_exit)(void*),
         uint32_t *user_stack, uint32_t *kernel_stack, const char * name, int uid, int priority) {
 
-    thread_t * new_thread = (thread_t *) kmalloc(sizeof (thread_t));
-    memset (new_thread, 0, sizeof (thread_t));
-    // Fill in the new thread name
-    new_thread->node.name = (char *) kmalloc(strlen(name) + 1);
-    strcpy(new_thread->node.name, name);
+    thread_t * new_thread = (thread_t *) kmem_cache_alloc(sys_base->thread_cache);
+    cpu_t * cpu;
+
+    if (!new_thread)
+        return NULL;
+    // Fill in the new thread name, if it has one
+    new_thread->node.name = NULL;
+    if (name) {
+        new_thread->node.name = (char *) kmalloc(strlen(name) + 1);
+        strcpy(new_thread->node.name, name);
+    }
     new_thread->node.pri = priority; // Start with default priority
-    new_thread->node.type = NT_THREAD;
+    new_thread->base_pri = priority;
+    // The cache constructed the rest, reset what a previous thread changed
+    new_thread->except_eip = 0;
+    new_thread->sig_wait = 0;
+    new_thread->sig_recvd = 0;
+    new_thread->on_switch = NULL;
+    new_thread->on_resume = NULL;
+    new_thread->faults = 0;
+    memset((uint8_t *) &new_thread->dl, 0, sizeof (sched_dl_t));
+    new_thread->ring = NULL;
+    new_thread->ring_wait = 0;
 
     *--user_stack = (uint32_t)at_exit;  // Fake return address.
     *--user_stack = (uint32_t)args;
@@ -26,16 +74,23 @@ thread_t *create_thread(int (*fn)(void*), void *args, int (*at_exit)(void*),
 
     new_thread->user_esp = (uint32_t)user_stack;
     new_thread->init_kernel_esp = (uint32_t)kernel_stack;
-    new_thread->page_directory = sys_base->act_page_directory;
+    new_thread->kernel_esp = (uint32_t)kernel_stack; // The launch frame goes here
+    new_thread->page_directory = this_cpu()->act_page_directory;
     new_thread->initial_eip = (unsigned int) fn;
 
+    // The thread and its message port are both known by the thread name
+    new_thread->msg_port.node.name = new_thread->node.name;
     add_head((list_head_t *) &sys_base->msgport_list, (list_node_t*) &new_thread->msg_port);
-    new_list((list_head_t *) &new_thread->msg_port.message_list);
+    name_register((list_node_t *) new_thread);
+    name_register((list_node_t *) &new_thread->msg_port);
+    init_msg_port(&new_thread->msg_port);
 
-    new_thread->msg_port.num_msg = 0;
-
-    enqueue((list_head_t *) &sys_base->thread_ready,
-            (list_node_t *) new_thread);
+    // Start on the CPU with the least work queued
+    new_thread->affinity = CPU_AFFINITY_ALL;
+    cpu = smp_least_loaded(new_thread->affinity);
+    new_thread->cpu = cpu->id;
+    rq_add(&cpu->thread_ready, new_thread);
+    smp_reschedule(cpu);
 
     new_thread->uid = uid;
 
@@ -43,21 +98,69 @@ thread_t *create_thread(int (*fn)(void*), void *args, int (*at_exit)(void*),
 }
 
 int _wait_for_flags(uint32_t flags) {
+    cpu_t * cpu = this_cpu();
+
     disable();
-    sys_base->running_thread->thread_flags &= (~TS_READY);
-    sys_base->running_thread->thread_flags |= TS_WAIT;
-    sys_base->running_thread->sig_wait |= flags;
+    // A deadline thread pays for the time it ran until it blocked
+    if(cpu->running_thread->dl.runtime)
+        dl_charge(cpu->running_thread);
+    cpu->running_thread->thread_flags &= (~TS_READY);
+    cpu->running_thread->thread_flags |= TS_WAIT;
+    cpu->running_thread->sig_wait |= flags;
     enqueue((list_head_t*) & sys_base->thread_wait,
-             (list_node_t*) sys_base->running_thread);
-    sys_base->sys_flags |= NEED_TASK_SWITCH;
+             (list_node_t*) cpu->running_thread);
+    cpu->sys_flags |= NEED_TASK_SWITCH;
 }
 
 /* system call wrapper to block a thread */
 void wait(int sig_flags)
 {
-    asm volatile("mov $0, %%eax; \
-                  mov %0, %%ebx; \
-                  int $0xFF" :: "r" (sig_flags) : "%eax", "%ebx");
+    do_syscall(SYS_WAIT, sig_flags, 0, 0);
+}
+
+/* Blocks the running thread until one of the flags is signaled,
+   or until the given number of ticks elapsed (0 waits forever) */
+void _wait_timeout(uint32_t flags, uint32_t ticks) {
+    thread_t * thread = this_cpu()->running_thread;
+
+    thread->sig_recvd &= (~ST_TIMEOUT);
+    if(ticks) {
+        timer_arm(&thread->timer, ticks);
+        flags |= ST_TIMEOUT;
+    }
+    _wait_for_flags(flags);
+}
+
+/* system call wrapper to block a thread for a while.
+   Returns -1 if the timeout expired first, 0 otherwise */
+int wait_timeout(int sig_flags, uint32_t ticks)
+{
+    do_syscall(SYS_WAIT_TIMEOUT, sig_flags, ticks, 0);
+    return (this_cpu()->running_thread->sig_recvd & ST_TIMEOUT) ? -1 : 0;
+}
+
+/* system call wrapper to put a thread to sleep */
+void sleep(uint32_t ticks)
+{
+    do_syscall(SYS_SLEEP, ticks, 0, 0);
+}
+
+/* Changes the priority of a thread. A ready thread moves to the run queue
+   level of its new priority, and its CPU looks again at what to run */
+void set_priority(thread_t *thread, int32_t pri) {
+    cpu_t * cpu = &cpus[thread->cpu];
+    int queued = (thread->thread_flags & TS_READY) &&
+                 thread != cpu->running_thread;
+
+    if(thread->node.pri == pri)
+        return;
+    if(queued)
+        rq_remove(&cpu->thread_ready, thread);
+    thread->node.pri = pri;
+    if(queued)
+        rq_add(&cpu->thread_ready, thread);
+    if(!(thread->thread_flags & TS_WAIT))
+        smp_reschedule(cpu);
 }
 
 void forbid(){
@@ -71,8 +174,10 @@ void permit(){
 void schedule() {
     /* This is the scheduler, called by one of the 2 interrupt handlers.
        We will check if the running thread has an event to be processed
-       or there is a thread with an higher priority to be ran. */
+       or there is a thread with an higher priority to be ran.
+       Every CPU schedules the threads of its own run queue. */
 
+    cpu_t * cpu = this_cpu();
     thread_t * top_thread;
 
     /* If multitasking is disabled, kernel was reentered or an immediate task switch is requested,
@@ -80,30 +185,44 @@ void schedule() {
     if(sys_base->forbid_counter > 0)
         return;
 
+    /* A CPU with no thread running (an AP that did not run any yet)
+       only has to switch if there is something to run */
+    if((cpu->running_thread->thread_flags & TS_RUN) == 0) {
+        if(rq_pick(&cpu->thread_ready))
+            cpu->sys_flags |= NEED_TASK_SWITCH;
+        return;
+    }
+
+    /* A running thread that just blocked is already on the wait list and
+       leaving the CPU, it must not be queued as ready too */
+    if((cpu->running_thread->thread_flags & TS_WAIT) != 0) {
+        cpu->sys_flags |= NEED_TASK_SWITCH;
+        return;
+    }
+
     /* If the running thread (if one is running) has a pending signal,
        reschedule immediately so it may be redispatched with a new time slice*/
-    if((sys_base->running_thread->thread_flags & TB_SIGNAL) != 0) {
-        enqueue((list_head_t*) & sys_base->thread_ready,
-                (list_node_t*) sys_base->running_thread);
-        sys_base->sys_flags |= NEED_TASK_SWITCH;
+    if((cpu->running_thread->thread_flags & TB_SIGNAL) != 0) {
+        rq_add(&cpu->thread_ready, cpu->running_thread);
+        cpu->sys_flags |= NEED_TASK_SWITCH;
         return;
     }
 
     /* Let's handle the normal case of thread preemption */
     /* Get a pointer to the highest priority ready-to-run thread */
-    top_thread = (thread_t *) get_head((list_head_t *) & sys_base->thread_ready);
+    top_thread = rq_pick(&cpu->thread_ready);
     /* If no more threads are ready, we must be the only running thread, so return */
     if(!top_thread)
         return;
-    /* If we get this far, we need to check either if the topmost thread has higher
-       priority than we do, or if the time slice ended. If so, preempt. */
-    if ( (sys_base->running_thread != NULL) && 
-         ( (sys_base->running_thread->node.pri < top_thread->node.pri) ||
-         (sys_base->sys_flags & TIME_SLICE_EXPIRED) ) ) {
-
-        enqueue((list_head_t*) & sys_base->thread_ready,
-                (list_node_t*) sys_base->running_thread);
-        sys_base->sys_flags |= NEED_TASK_SWITCH;
+    /* If we get this far, we need to check either if the topmost thread has to
+       run before us (an earlier deadline or a higher priority), or if the time
+       slice (or the deadline budget) ended. If so, preempt. */
+    if ( (cpu->running_thread != NULL) && 
+         ( rq_before(top_thread, cpu->running_thread) ||
+         (cpu->sys_flags & TIME_SLICE_EXPIRED) ) ) {
+
+        rq_add(&cpu->thread_ready, cpu->running_thread);
+        cpu->sys_flags |= NEED_TASK_SWITCH;
     }
 }
 
@@ -112,23 +231,43 @@ void schedule() {
 /* This function gets called from the interrupt handler if a thread switch
  * is needed by testing NEED_TASK_SWITCH */
 void switch_threads() {
-    thread_t * running_thread = sys_base->running_thread;
+    cpu_t * cpu = this_cpu();
+    thread_t * running_thread = cpu->running_thread;
     thread_t * next_thread;
     
     /* Unset the scheduling attention flags */
-    sys_base->sys_flags &= (~NEED_TASK_SWITCH);
-    sys_base->sys_flags &= (~TIME_SLICE_EXPIRED);
+    cpu->sys_flags &= (~NEED_TASK_SWITCH);
+    cpu->sys_flags &= (~TIME_SLICE_EXPIRED);
     /* Unset the thread's running flag, for the dispatcher to know
        the thread is not running, so it will not corrupt it's stack */
     running_thread->thread_flags &= (~TS_RUN);
     /* Try to get a thread structure from the ready queue */
-    while(! (next_thread = (thread_t*) get_head((list_head_t *)&sys_base->thread_ready))) {
+    while(! (next_thread = rq_take(&cpu->thread_ready))) {
         /* If we get inside this loop, no thread is ready to run,
            and the timeslice counter has expired, so idle the processor
            until an interrupt comes and readies a thread */
-        sys_base->sys_flags |= NEED_SCHEDULE; // Set the rescheduling flag
-        enable();  // Enable interrupts
-        asm volatile("hlt"); // Halt the processor
+        cpu->sys_flags |= NEED_SCHEDULE; // Set the rescheduling flag
+        /* Use the idle time to carve RAM into the page allocator */
+        disable();
+        if(pm_carve())
+            continue;
+        /* Or take some work from a busier CPU */
+        if(smp_steal(cpu))
+            continue;
+        /* Skip the ticks with nothing to do while halted. sti only takes
+           effect after hlt starts, so no wakeup is lost in between.
+           Only the boot CPU drives the PIT, the others keep their
+           LAPIC tick. It keeps ticking too while a deadline thread
+           waits for its replenishment. Other CPUs may enter the kernel
+           meanwhile. */
+        if(cpu->id == 0 && !get_head(&cpu->thread_ready.throttled))
+            timer_idle_enter();
+        smp_unlock();
+        asm volatile("sti; hlt"); // Halt the processor
+        disable();
+        smp_lock();
+        if(cpu->id == 0)
+            timer_idle_exit();
 
         /* At this time, the processor is halted and k_reenter == 0.
            Whenever an interrupt fires, k_reenter is incremented when
@@ -137,50 +276,194 @@ void switch_threads() {
            because it means it is the last level before the return to
            ring 3 (k_reenter == -1) */
     }
-    /* There is a thread to be run - unlink it from the list */
-    remove((list_node_t *) next_thread);
+    /* There is a thread to be run, unlinked from the run queue */
     /* Set the running thread to be the new thread */
-    running_thread = sys_base->running_thread = next_thread;
+    running_thread = cpu->running_thread = next_thread;
     /* Prepare the page directory for the dispatcher to change them */
-    sys_base->act_page_directory = running_thread->page_directory;
+    cpu->act_page_directory = running_thread->page_directory;
     /* Restart the timeslice counter and set the thread as running */
-    sys_base->ts_curr_count = sys_base->std_ts_quantum;
+    cpu->ts_curr_count = sys_base->std_ts_quantum;
     running_thread->thread_flags |= TS_RUN;
+    /* A deadline thread is charged from now on */
+    if(running_thread->dl.runtime)
+        running_thread->dl.stamp = ktime_ns();
     /* Set the thread's kernel stack for the interrupt handlers */
     set_kernel_stack(running_thread->init_kernel_esp);
     //k_reenter--;
 }
 
-/* Function to find a thread by name*/
+/* Function to find a thread by name, through the name registry */
 thread_t * find_thread(char * name)  {
-    /* If the thread is running, return it.
-       This only makes sense if to avoid wreaking havoc in a int handler */
-    if(strcmp(sys_base->running_thread->node.name, name) == 0)
-        return sys_base->running_thread;
-
-    forbid();
-    thread_t * thread = (thread_t*) get_head((list_head_t *) &sys_base->thread_wait);
-
-    while(thread){
-        if(strcmp(thread->node.name, name) == 0)
-        {
-            permit();
-            return thread;
-        }
-        thread = (thread_t*) get_next((list_node_t *) thread);
+    return (thread_t *) name_lookup(name, NT_THREAD);
+}
+
+/* Function to find a message port by name */
+msg_port_t * find_port(char * name)  {
+    return (msg_port_t *) name_lookup(name, NT_MSGPORT);
+}
+
+/* Clamps a thread priority to a run queue level */
+static inline int rq_level(thread_t *thread) {
+    if(thread->node.pri < 0)
+        return 0;
+    if(thread->node.pri >= RQ_PRIORITIES)
+        return RQ_PRIORITIES - 1;
+    return thread->node.pri;
+}
+
+void rq_init(run_queue_t *rq, int cpu) {
+    int level;
+
+    rq->bitmap = 0;
+    rq->count = 0;
+    for(level = 0; level < RQ_PRIORITIES; level++)
+        new_list(&rq->level[level]);
+    new_list(&rq->deadline);
+    new_list(&rq->throttled);
+    spin_init_cpu(&rq->lock, "run queue", cpu);
+}
+
+/* Queues a ready thread behind the ones of the same priority, or
+   a deadline thread by its deadline */
+void rq_add(run_queue_t *rq, thread_t *thread) {
+    int level = rq_level(thread);
+    uint32_t flags = spin_lock_irqsave(&rq->lock);
+
+    if(thread->dl.runtime) {
+        rq_insert_dl(thread->dl.budget > 0 ? &rq->deadline : &rq->throttled,
+                     thread);
+    } else {
+        add_tail(&rq->level[level], (list_node_t *) thread);
+        rq->bitmap |= (1 << level);
     }
+    rq->count++;
+    spin_unlock_irqrestore(&rq->lock, flags);
+}
+
+/* Unlinks a queued thread */
+void rq_remove(run_queue_t *rq, thread_t *thread) {
+    uint32_t flags = spin_lock_irqsave(&rq->lock);
+
+    rq_unlink(rq, thread);
+    spin_unlock_irqrestore(&rq->lock, flags);
+}
 
-    thread = (thread_t*) get_head((list_head_t *) &sys_base->thread_ready);
+/* Returns the deadline thread with the earliest deadline, or else the
+   first thread of the highest non-empty level, or NULL */
+thread_t * rq_pick(run_queue_t *rq) {
+    thread_t * thread;
+    uint32_t flags = spin_lock_irqsave(&rq->lock);
 
-    while(thread){
-        if(strcmp(thread->node.name, name) == 0)
-        {
-            permit();
-            return thread;
+    thread = rq_first(rq);
+    spin_unlock_irqrestore(&rq->lock, flags);
+    return thread;
+}
+
+/* Unlinks and returns the thread rq_pick() would return, or NULL */
+thread_t * rq_take(run_queue_t *rq) {
+    thread_t * thread;
+    uint32_t flags = spin_lock_irqsave(&rq->lock);
+
+    if((thread = rq_first(rq)))
+        rq_unlink(rq, thread);
+    spin_unlock_irqrestore(&rq->lock, flags);
+    return thread;
+}
+
+/* Unlinks and returns the last thread of the lowest non-empty level that
+   may run on a CPU of the affinity mask, passing over skip. Returns NULL
+   if there is none. Deadline threads are never taken, they were admitted
+   on this CPU */
+thread_t * rq_steal(run_queue_t *rq, uint32_t affinity, thread_t *skip) {
+    list_node_t * node;
+    uint32_t bitmap, flags = spin_lock_irqsave(&rq->lock);
+
+    // Lowest levels first, the lowest level is the lowest bit set
+    for(bitmap = rq->bitmap; bitmap; bitmap &= bitmap - 1) {
+        list_head_t * level = &rq->level[__builtin_ctz(bitmap)];
+
+        for(node = level->tailPrev; node->prev; node = node->prev) {
+            if((thread_t *) node == skip ||
+               !(((thread_t *) node)->affinity & affinity))
+                continue;
+            rq_unlink(rq, (thread_t *) node);
+            spin_unlock_irqrestore(&rq->lock, flags);
+            return (thread_t *) node;
         }
-        thread = (thread_t*) get_next((list_node_t *) thread);
     }
+    spin_unlock_irqrestore(&rq->lock, flags);
+    return NULL;
+}
+
+/* Moves the throttled deadline threads whose replenishment time came
+   back to the deadline list. Returns 1 if any was moved */
+int rq_replenish(run_queue_t *rq, uint64_t now) {
+    thread_t * thread;
+    uint32_t flags;
+    int moved = 0;
+
+    if(!get_head(&rq->throttled))
+        return 0;
+    flags = spin_lock_irqsave(&rq->lock);
+    while((thread = (thread_t *) get_head(&rq->throttled)) &&
+          thread->dl.abs_deadline <= now) {
+        remove((list_node_t *) thread);
+        dl_replenish(thread);
+        rq_insert_dl(&rq->deadline, thread);
+        moved = 1;
+    }
+    spin_unlock_irqrestore(&rq->lock, flags);
+    return moved;
+}
 
-    permit();
+/* Unlinks a queued thread, with the queue locked */
+static void rq_unlink(run_queue_t *rq, thread_t *thread) {
+    int level = rq_level(thread);
+
+    remove((list_node_t *) thread);
+    if(!thread->dl.runtime && !get_head(&rq->level[level]))
+        rq->bitmap &= ~(1 << level);
+    rq->count--;
+}
+
+/* Returns the thread to run next, with the queue locked */
+static thread_t * rq_first(run_queue_t *rq) {
+    thread_t * thread;
+
+    if((thread = (thread_t *) get_head(&rq->deadline)))
+        return thread;
+    // The highest level is the highest bit set, found with bsr
+    if(rq->bitmap)
+        return (thread_t *) get_head(&rq->level[31 - __builtin_clz(rq->bitmap)]);
     return NULL;
 }
+
+/* Inserts a deadline thread behind the ones with the same or an earlier
+   deadline (or replenishment time) */
+static void rq_insert_dl(list_head_t *list, thread_t *thread) {
+    list_node_t * next;
+
+    for(next = get_head(list); next; next = get_next(next))
+        if(thread->dl.abs_deadline < ((thread_t *) next)->dl.abs_deadline) {
+            thread->node.next = next;
+            thread->node.prev = next->prev;
+            next->prev->next = (list_node_t *) thread;
+            next->prev = (list_node_t *) thread;
+            return;
+        }
+    add_tail(list, (list_node_t *) thread);
+}
+
+/* Returns 1 if the ready thread a has to run before the running thread b:
+   deadline threads with budget left come first, earliest deadline first,
+   then the others by priority */
+static int rq_before(thread_t *a, thread_t *b) {
+    int a_dl = a->dl.runtime && a->dl.budget > 0;
+    int b_dl = b->dl.runtime && b->dl.budget > 0;
+
+    if(a_dl != b_dl)
+        return a_dl;
+    if(a_dl)
+        return a->dl.abs_deadline < b->dl.abs_deadline;
+    return b->node.pri < a->node.pri;
+}
@@ -12,6 +12,8 @@
 
 #include "common.h"
 #include "pmm.h"
+#include "timer.h"
+#include "spinlock.h"
 
 /*! \brief Definition of the possible thread states (TS_*).
  *
@@ -31,17 +33,47 @@
  */
 #define ST_MESG      1    //!< Thread received a message
 #define ST_EXCEPT    2    //!< Thread received an exception
+#define ST_TIMEOUT   4    //!< Thread timer expired
+#define ST_SEMAPHORE 8    //!< Thread was handed a semaphore
+#define ST_PORT      16   //!< A full port the thread posts to has room again
+
+struct semaphore_s;
+struct message_s;
+struct sysring_s;
 
 /*! \brief Message Port structure.
  *
  * This structure is a message port, where threads can post and receive
- * messages to and from each other.
+ * messages to and from each other. The messages are copied into a ring
+ * of MAX_MESSAGES slots allocated with the port, so posting never
+ * allocates memory and a full port refuses the message.
  */
 struct msg_port_s {
     list_node_t node;          //!< Node to link this port to others in a list
-    list_head_t message_list;  //!< Messages posted on this port
+    struct message_s * slots;  //!< Ring of MAX_MESSAGES message slots
+    uint32_t drops;            //!< Messages refused because the port was full
+    spinlock_t lock;           //!< Guards the ring
+    uint8_t head;              //!< Slot of the oldest message
     uint8_t num_msg;           //!< Number of messages posted
-};
+    uint8_t high_water;        //!< Most messages ever queued at once
+} __attribute__((packed));
+
+/*! \brief Deadline scheduling parameters (EDF/CBS), all times in ns.
+ *
+ * A thread with a runtime is a deadline thread: it gets up to runtime
+ * every period, and runs ahead of every normal thread while it has
+ * budget left, the earliest abs_deadline first.
+ */
+typedef struct sched_dl {
+    uint64_t runtime;            //!< Budget per period, 0 for a normal thread.
+    uint64_t deadline;           //!< Relative deadline, at most the period.
+    uint64_t period;             //!< Budget replenishment period.
+    uint64_t abs_deadline;       //!< Current deadline, or replenishment time once throttled.
+    int64_t budget;              //!< Runtime left until abs_deadline.
+    uint64_t stamp;              //!< When the budget was last charged.
+    uint32_t bw;                 //!< Admitted bandwidth, runtime / deadline << DL_BW_SHIFT.
+    uint32_t overruns;           //!< Times the budget ran out before the thread blocked.
+} __attribute__((packed)) sched_dl_t;
 
 /*! \brief Thread Descriptor structure.
  *
@@ -63,17 +95,60 @@ struct thread_s{
     uint32_t sig_wait;           //!< Signals being waited by the thread.
     uint32_t sig_recvd;          //!< Signals received by the thread.
     struct msg_port_s msg_port;  //!< Thread's message port.
-    list_head_t msg_wait_proc;   //!< List of processes waiting to post a message, if the port is full.
+    list_head_t msg_wait_proc;   //!< List of processes waiting to post a message, if the port is full (thread_t.post_node).
     (void*) (*on_switch)();      //!< Function called when the task loses the CPU.
     (void*) (*on_resume)();      //!< Function called when the task regains the CPU.
+    uint32_t faults;             //!< Page faults taken by the thread.
+    ktimer_t timer;              //!< Sleep and wait timeout timer.
+    uint32_t cpu;                //!< CPU whose run queue the thread is queued in.
+    uint32_t affinity;           //!< Bit n set if the thread may run on CPU n.
+    int32_t base_pri;            //!< Priority without the ones inherited from mutex waiters.
+    struct semaphore_s * sem_blocked; //!< Semaphore the thread waits for, or NULL.
+    list_node_t sem_node;        //!< Links the thread in the waiters of sem_blocked.
+    list_head_t sem_held;        //!< Mutexes held by the thread.
+    sched_dl_t dl;               //!< Deadline class parameters.
+    struct sysring_s * ring;     //!< Batched system call ring, or NULL.
+    uint32_t ring_sq_head;       //!< Next submission the kernel takes.
+    uint32_t ring_cq_tail;       //!< Next completion the kernel fills.
+    uint32_t ring_wait;          //!< Set while blocked in a RING_OP_WAIT.
+    uint32_t ring_wait_data;     //!< user_data of that RING_OP_WAIT.
+    list_node_t post_node;       //!< Links the thread in the msg_wait_proc of a full port.
 } __attribute__((packed));
 
 typedef struct msg_port_s msg_port_t;
 
 typedef struct thread_s thread_t;
 
+/*! \brief Number of thread priority levels.
+ *
+ * Priorities outside 0...RQ_PRIORITIES-1 are clamped when queued.
+ */
+#define RQ_PRIORITIES 32
+
+/*! \brief Run queue structure.
+ *
+ * One FIFO of ready threads per priority level, and a bitmap of the
+ * non-empty levels, so queueing, unqueueing and picking the next thread
+ * all take constant time. Deadline threads with budget left are kept
+ * apart, sorted by deadline, and are picked first; the throttled ones
+ * wait for their replenishment. The rq_* functions take the lock
+ * themselves.
+ */
+struct run_queue_s {
+    uint32_t bitmap;                     //!< Bit n set if level n is not empty.
+    uint32_t count;                      //!< Number of queued threads.
+    list_head_t level[RQ_PRIORITIES];    //!< Ready threads, per priority.
+    list_head_t deadline;                //!< Deadline threads, earliest deadline first.
+    list_head_t throttled;               //!< Deadline threads out of budget, by replenishment.
+    spinlock_t lock;                     //!< Taken by the CPUs touching the queue.
+} __attribute__((packed));
+
+typedef struct run_queue_s run_queue_t;
+
 thread_t *init_threading ();
 
+void thread_ctor(void *obj);
+
 thread_t *create_thread(int (*fn)(void*), void *args, int (*at_exit)(void*),
         uint32_t *user_stack, uint32_t *kernel_stack, const char * name, int uid, int priority);
 
@@ -81,6 +156,8 @@ void switch_thread (thread_t *next);
 
 void schedule();
 
+void set_priority(thread_t *thread, int32_t pri);
+
 void forbid();
 
 void permit();
@@ -89,6 +166,28 @@ int _wait_for_flags(uint32_t flags);
 
 void wait(int);
 
+int wait_timeout(int sig_flags, uint32_t ticks);
+
+void sleep(uint32_t ticks);
+
+void _wait_timeout(uint32_t flags, uint32_t ticks);
+
 thread_t * find_thread(char * name);
 
+msg_port_t * find_port(char * name);
+
+void rq_init(run_queue_t *rq, int cpu);
+
+void rq_add(run_queue_t *rq, thread_t *thread);
+
+void rq_remove(run_queue_t *rq, thread_t *thread);
+
+thread_t * rq_pick(run_queue_t *rq);
+
+thread_t * rq_take(run_queue_t *rq);
+
+thread_t * rq_steal(run_queue_t *rq, uint32_t affinity, thread_t *skip);
+
+int rq_replenish(run_queue_t *rq, uint64_t now);
+
 #endif	/* _THREAD_H */
@@ -8,41 +8,273 @@
 #include "idt.h"
 #include "thread.h"
 #include "sysbase.h"
+#include "cpu.h"
+#include "kprintf.h"
+#include "message.h"
+#include "clock.h"
+#include "deadline.h"
+#include "ring.h"
+#include "smp.h"
+
+#define MAX_BOOT_PHASES 16
+#define PIT_FREQUENCY   1193180
+#define PIT_PERIODIC    0x36    // Channel 0, rate generator
+#define PIT_ONESHOT     0x30    // Channel 0, interrupt on terminal count
 
 uint32_t system_tick = 0;
+extern uint32_t cr3_reloads;
 
-static void timer_callback (registers_t *regs)
+// Ticks left until the per-second statistics are sampled again
+static uint32_t tick_frequency = 0;
+static uint32_t stats_countdown = 0;
+static uint32_t last_cr3_reloads = 0;
+
+// PIT divisor of one tick, and ticks covered by the one-shot count
+// programmed while idle (0 when ticking periodically)
+static uint32_t pit_divisor = 0;
+static uint32_t oneshot_ticks = 0;
+static int idle = 0;
+static uint32_t wakeups = 0;
+static uint32_t last_wakeups = 0;
+
+// Time-stamp counter readings taken at the end of each boot phase
+static struct {
+  const char *name;
+  uint64_t tsc;
+} boot_phases[MAX_BOOT_PHASES];
+static int num_boot_phases = 0;
+
+static void timer_place (ktimer_t *timer);
+static void timer_run ();
+static uint32_t timer_next_event (uint32_t max);
+
+static void pit_program (uint8_t mode, uint32_t divisor)
+{
+  // Send the command byte.
+  outb(0x43, mode);
+
+  // Divisor has to be sent byte-wise, so split here into upper/lower bytes.
+  outb(0x40, (uint8_t)(divisor & 0xFF));
+  outb(0x40, (uint8_t)((divisor >> 8) & 0xFF));
+}
+
+static void timer_tick ()
 {
     system_tick++;
-    if(sys_base->ts_curr_count < -1)
+    clock_tick();
+    if(idle)
+        sys_base->idle_ticks++;
+    timer_run();
+    if(--stats_countdown == 0){
+        stats_countdown = tick_frequency;
+        sys_base->cr3_reload_rate = cr3_reloads - last_cr3_reloads;
+        last_cr3_reloads = cr3_reloads;
+        sys_base->wakeup_rate = wakeups - last_wakeups;
+        last_wakeups = wakeups;
+    }
+    timer_slice();
+}
+
+// Counts down the time slice of the running CPU. The boot CPU calls it
+// on every PIT tick, the others on every LAPIC timer tick.
+void timer_slice ()
+{
+    cpu_t *cpu = this_cpu();
+    thread_t *thread = cpu->running_thread;
+
+    // A deadline thread out of budget gives the CPU up like at the end of
+    // its time slice, and the throttled ones may be due again
+    if(thread->dl.runtime && (thread->thread_flags & TS_RUN) && dl_charge(thread))
+        cpu->sys_flags |= TIME_SLICE_EXPIRED | NEED_SCHEDULE;
+    if(rq_replenish(&cpu->thread_ready, ktime_ns()))
+        cpu->sys_flags |= NEED_SCHEDULE;
+    // Run the batched system calls of a thread that polls its ring
+    ring_poll(cpu);
+
+    if(cpu->ts_curr_count < -1)
       return;
 
-    sys_base->ts_curr_count--;
+    cpu->ts_curr_count--;
 
-    if(sys_base->ts_curr_count < 0){
-        sys_base->sys_flags |= TIME_SLICE_EXPIRED;
-        sys_base->sys_flags |= NEED_SCHEDULE;
+    if(cpu->ts_curr_count < 0){
+        cpu->sys_flags |= TIME_SLICE_EXPIRED;
+        cpu->sys_flags |= NEED_SCHEDULE;
     }
 }
 
+static void timer_callback (registers_t *regs)
+{
+    uint32_t ticks = 1;
+
+    // A one-shot expiry stands for all the ticks skipped while idle
+    if(oneshot_ticks){
+        ticks = oneshot_ticks;
+        oneshot_ticks = 0;
+        pit_program(PIT_PERIODIC, pit_divisor);
+    }
+    while(ticks--)
+        timer_tick();
+}
+
 void init_timer (uint32_t frequency)
 {
+  int level, slot;
+
+  for (level = 0; level < TW_LEVELS; level++)
+    for (slot = 0; slot < TW_SLOTS; slot++)
+      new_list(&sys_base->timer_wheel.slot[level][slot]);
+  sys_base->timer_wheel.now = 0;
+
   // Firstly, register our timer callback.
+  tick_frequency = stats_countdown = frequency;
   register_interrupt_handler(IRQ0, &timer_callback);
 
   // The value we send to the PIT is the value to divide it's input clock
   // (1193180 Hz) by, to get our required frequency. Important to note is
   // that the divisor must be small enough to fit into 16-bits.
-  uint32_t divisor = 1193180 / frequency;
+  pit_divisor = PIT_FREQUENCY / frequency;
+  pit_program(PIT_PERIODIC, pit_divisor);
+}
 
-  // Send the command byte.
-  outb(0x43, 0x36);
+// Called by the idle loop, with interrupts disabled, before halting:
+// unless the next tick has work to do, the periodic tick is replaced by
+// a one-shot count up to the next timer event. The 16-bit PIT counter
+// limits it to about 55ms.
+void timer_idle_enter ()
+{
+  uint32_t ticks = timer_next_event(0xFFFF / pit_divisor);
 
-  // Divisor has to be sent byte-wise, so split here into upper/lower bytes.
-  uint8_t l = (uint8_t)(divisor & 0xFF);
-  uint8_t h = (uint8_t)( (divisor>>8) & 0xFF );
+  idle = 1;
+  if (ticks <= 1)
+    return;
+  oneshot_ticks = ticks;
+  pit_program(PIT_ONESHOT, ticks * pit_divisor);
+}
+
+// Called by the idle loop, with interrupts disabled, after every wakeup:
+// if another interrupt came before the one-shot expiry, the ticks gone
+// by are accounted and the periodic tick is restored.
+void timer_idle_exit ()
+{
+  uint32_t count, total, elapsed;
+
+  wakeups++;
+  if (oneshot_ticks) {
+    // Latch and read the count left
+    outb(0x43, 0x00);
+    count = inb(0x40);
+    count |= inb(0x40) << 8;
+    total = oneshot_ticks * pit_divisor;
+    elapsed = count > total ? oneshot_ticks : (total - count) / pit_divisor;
+    oneshot_ticks = 0;
+    pit_program(PIT_PERIODIC, pit_divisor);
+    while (elapsed--)
+      timer_tick();
+  }
+  idle = 0;
+}
+
+void boot_phase (const char *name)
+{
+  if (num_boot_phases == MAX_BOOT_PHASES)
+    return;
+  boot_phases[num_boot_phases].name = name;
+  boot_phases[num_boot_phases].tsc = read_tsc();
+  num_boot_phases++;
+}
+
+void boot_report ()
+{
+  int i;
+
+  kprintf("Boot time breakdown (kcycles):\n");
+  for (i = 1; i < num_boot_phases; i++)
+    kprintf("  %s: %u\n", boot_phases[i].name,
+            (uint32_t) ((boot_phases[i].tsc - boot_phases[i-1].tsc) / 1000));
+  kprintf("  total: %u\n",
+          (uint32_t) ((boot_phases[num_boot_phases-1].tsc - boot_phases[0].tsc) / 1000));
+}
+
+void timer_arm (ktimer_t *timer, uint32_t ticks)
+{
+  if (timer->armed)
+    remove((list_node_t *) timer);
+  if (ticks == 0)
+    ticks = 1;
+  // Longer timeouts are cut to the wheel range
+  if (ticks > TW_MAX_TICKS)
+    ticks = TW_MAX_TICKS;
+  timer->expires = sys_base->timer_wheel.now + ticks;
+  timer->armed = 1;
+  timer_place(timer);
+  // Armed from another CPU while the boot CPU sleeps on a one-shot count
+  // ending later: wake it up, so it goes back to the periodic tick
+  if (oneshot_ticks > ticks && this_cpu() != &cpus[0])
+    smp_reschedule(&cpus[0]);
+}
+
+void timer_cancel (ktimer_t *timer)
+{
+  if (!timer->armed)
+    return;
+  remove((list_node_t *) timer);
+  timer->armed = 0;
+}
+
+// Puts a timer in the slot of the lowest level able to hold its delay.
+static void timer_place (ktimer_t *timer)
+{
+  timer_wheel_t *wheel = &sys_base->timer_wheel;
+  uint32_t delta = timer->expires - wheel->now;
+  int level = 0;
+
+  while (level < TW_LEVELS - 1 && delta >= (1u << (TW_BITS * (level + 1))))
+    level++;
+  add_tail(&wheel->slot[level][(timer->expires >> (TW_BITS * level)) & TW_MASK],
+           (list_node_t *) timer);
+}
+
+// Advances the wheel by one tick. Whenever a level wraps around, the
+// next slot of the level above is spread over the levels below, then
+// the timers in the current level 0 slot are fired.
+static void timer_run ()
+{
+  timer_wheel_t *wheel = &sys_base->timer_wheel;
+  ktimer_t *timer;
+  uint32_t index;
+  int level;
+
+  wheel->now++;
+  for (level = 1; level < TW_LEVELS; level++) {
+    if ((wheel->now >> (TW_BITS * (level - 1))) & TW_MASK)
+      break;
+    index = (wheel->now >> (TW_BITS * level)) & TW_MASK;
+    while ((timer = (ktimer_t *) get_head(&wheel->slot[level][index]))) {
+      remove((list_node_t *) timer);
+      timer_place(timer);
+    }
+  }
+
+  index = wheel->now & TW_MASK;
+  while ((timer = (ktimer_t *) get_head(&wheel->slot[0][index]))) {
+    remove((list_node_t *) timer);
+    timer->armed = 0;
+    _signal(timer->thread, timer->sig);
+  }
+}
+
+// Ticks until the wheel may have timers to fire, at most max. Level 0
+// slots only hold the timers expiring on their own tick; a level wrap
+// may bring timers down, so it counts as an event too.
+static uint32_t timer_next_event (uint32_t max)
+{
+  timer_wheel_t *wheel = &sys_base->timer_wheel;
+  uint32_t ticks, when;
 
-  // Send the frequency divisor.
-  outb(0x40, l);
-  outb(0x40, h);
+  for (ticks = 1; ticks < max; ticks++) {
+    when = wheel->now + ticks;
+    if (!(when & TW_MASK) || get_head(&wheel->slot[0][when & TW_MASK]))
+      break;
+  }
+  return ticks;
 }
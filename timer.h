@@ -7,6 +7,49 @@
 
 #include "common.h"
 
+// The timer wheel has TW_LEVELS levels of TW_SLOTS slots. Level n slots
+// are TW_SLOTS^n ticks wide, so timeouts up to TW_MAX_TICKS can be armed.
+#define TW_BITS      6
+#define TW_SLOTS     (1 << TW_BITS)
+#define TW_MASK      (TW_SLOTS - 1)
+#define TW_LEVELS    4
+#define TW_MAX_TICKS ((1 << (TW_BITS * TW_LEVELS)) - 1)
+
+struct thread_s;
+
+// A timer signals its thread when it expires.
+typedef struct ktimer {
+  list_node_t node;             // Links the timer in its wheel slot
+  uint32_t expires;             // Wheel time at which the timer fires
+  struct thread_s *thread;      // Thread to be signaled
+  uint32_t sig;                 // Signals sent on expiry
+  uint32_t armed;               // Set while the timer is in the wheel
+} __attribute__((packed)) ktimer_t;
+
+typedef struct timer_wheel {
+  uint32_t now;                 // Ticks processed so far
+  list_head_t slot[TW_LEVELS][TW_SLOTS];
+} __attribute__((packed)) timer_wheel_t;
+
 void init_timer (uint32_t frequency);
 
+// Arms a timer to fire in the given number of ticks (re-arms it if armed).
+void timer_arm (ktimer_t *timer, uint32_t ticks);
+
+// Takes an armed timer out of the wheel.
+void timer_cancel (ktimer_t *timer);
+
+// Counts down the time slice of the running CPU.
+void timer_slice ();
+
+// Stops and restarts the periodic tick around an idle halt.
+void timer_idle_enter ();
+void timer_idle_exit ();
+
+// Marks the end of a boot phase, for the boot-time breakdown.
+void boot_phase (const char *name);
+
+// Prints how long every boot phase took.
+void boot_report ();
+
 #endif
@@ -0,0 +1,269 @@
+/* vmm.c - Krypton virtual memory areas
+ *
+ * Memory is reserved as areas of an address space and populated lazily:
+ * page_fault() asks vm_fault() for the area of the faulting address,
+ * which maps a zeroed frame there (and extends a stack downwards).
+ * Thread stacks get a 1MiB slot each, of which only the touched pages
+ * ever take RAM. The lowest page of a slot stays unmapped as a guard.
+ */
+
+#include "vmm.h"
+#include "pmm.h"
+#include "sysbase.h"
+#include "common.h"
+#include "panic.h"
+
+/***************************************
+ * Static Function Prototypes
+ ***************************************/
+static vm_space_t * vm_space_of(unsigned long addr);
+
+static vma_t * vma_find(vm_space_t * space, unsigned long addr);
+
+static vma_t * vma_add(vm_space_t * space, unsigned long start, unsigned long end,
+        unsigned long limit, uint32_t flags, uint32_t prot);
+
+/***************************************
+ * Globals
+ ***************************************/
+extern void *kernelpagedirPtr;
+
+/* vm_init() - registers the boot address space
+ *
+ * Called by mm_init() once the heap is online
+ */
+void vm_init() {
+    vm_space_t * space = &sys_base->kernel_space;
+
+    new_list((list_head_t *) &sys_base->vm_space_list);
+    memset((uint8_t *) sys_base->vm_stack_map, 0, sizeof (sys_base->vm_stack_map));
+
+    space->node.name = "kernel";
+    space->node.type = NT_MEMORY;
+    space->page_directory = kernelpagedirPtr;
+    new_list((list_head_t *) &space->vma_list);
+    add_tail((list_head_t *) &sys_base->vm_space_list, (list_node_t *) space);
+
+    // Heap, slab and stack pages are mapped from any address space, and
+    // must show up in all of them: their page tables are made now, before
+    // any clone
+    mm_map_pagetables((void *) SH_HEAP_START, (void *) VM_STACK_START,
+            PAGE_WRITE | PAGE_USER);
+    mm_map_pagetables((void *) SLAB_START, (void *) SLAB_END,
+            PAGE_WRITE | PAGE_USER);
+    mm_map_pagetables((void *) VM_STACK_START, (void *) VM_STACK_END,
+            PAGE_WRITE | PAGE_USER);
+}
+
+/* vm_space_create() - registers the address space of a page directory */
+vm_space_t * vm_space_create(pagedir_t * page_directory) {
+    vm_space_t * space = (vm_space_t *) kmalloc(sizeof (vm_space_t));
+
+    memset((uint8_t *) space, 0, sizeof (vm_space_t));
+    space->node.type = NT_MEMORY;
+    space->page_directory = page_directory;
+    new_list((list_head_t *) &space->vma_list);
+    add_tail((list_head_t *) &sys_base->vm_space_list, (list_node_t *) space);
+    return space;
+}
+
+/* vm_space_clone() - copy-on-write clone of the current address space,
+ * along with its user areas
+ */
+vm_space_t * vm_space_clone() {
+    vm_space_t * source = vm_space_of(0);
+    vm_space_t * space = vm_space_create(clone_actual_directory());
+    vma_t * vma;
+
+    if (source)
+        for (vma = (vma_t *) get_head((list_head_t *) &source->vma_list); vma;
+             vma = (vma_t *) get_next((list_node_t *) vma))
+            vma_add(space, vma->start, vma->end, vma->limit, vma->flags, vma->prot);
+    return space;
+}
+
+/* vm_map_anon() - reserves a zero-filled area in the current address space
+ *
+ * Returns NULL if the range overlaps another area or the kernel boundary
+ */
+vma_t * vm_map_anon(unsigned long start, unsigned long size, uint32_t prot) {
+    vm_space_t * space = vm_space_of(start);
+    unsigned long end = (start + size + 0xFFF) & PAGE_MASK;
+    vma_t * vma;
+
+    start &= PAGE_MASK;
+    if (!space || end <= start ||
+        (start < KERNEL_VIRTUAL_BASE && end > KERNEL_VIRTUAL_BASE))
+        return NULL;
+    for (vma = (vma_t *) get_head((list_head_t *) &space->vma_list); vma;
+         vma = (vma_t *) get_next((list_node_t *) vma))
+        if (start < vma->end && end > vma->limit)
+            return NULL;
+    return vma_add(space, start, end, start, VMA_ANON, prot);
+}
+
+/* vm_unmap() - gives back the pages of an area and drops it */
+void vm_unmap(vma_t * vma) {
+    unsigned long addr, slot;
+    phys_addr_t page;
+
+    for (addr = vma->start; addr < vma->end; addr += 0x1000)
+        if ((page = get_physaddr((void *) addr))) {
+            pm_free(page);
+            mm_unmap((void *) addr);
+        }
+
+    // Release the stack slot too
+    if (vma->end > VM_STACK_START && vma->end <= VM_STACK_END) {
+        slot = (vma->end - 1 - VM_STACK_START) / VM_STACK_SLOT;
+        sys_base->vm_stack_map[slot / 32] &= ~(1 << (slot % 32));
+    }
+    remove((list_node_t *) vma);
+    kfree(vma);
+}
+
+/* vm_stack_alloc() - reserves a thread stack
+ *
+ * Returns the top of the stack. Nothing is mapped until it is used.
+ */
+void * vm_stack_alloc() {
+    unsigned long slot, base;
+
+    for (slot = 0; slot < VM_STACK_SLOTS; slot++)
+        if (!(sys_base->vm_stack_map[slot / 32] & (1 << (slot % 32))))
+            break;
+    if (slot == VM_STACK_SLOTS)
+        panic("Out of thread stack slots.\n");
+    sys_base->vm_stack_map[slot / 32] |= 1 << (slot % 32);
+
+    base = VM_STACK_START + slot * VM_STACK_SLOT;
+    vma_add(&sys_base->kernel_space, base + VM_STACK_SLOT - 0x1000,
+            base + VM_STACK_SLOT, base + 0x1000, VMA_ANON | VMA_GROWSDOWN,
+            PAGE_WRITE | PAGE_USER);
+    return (void *) (base + VM_STACK_SLOT);
+}
+
+/* vm_stack_free() - gives back a stack reserved by vm_stack_alloc() */
+void vm_stack_free(void * top) {
+    vma_t * vma = vma_find(&sys_base->kernel_space, (unsigned long) top - 1);
+
+    if (vma)
+        vm_unmap(vma);
+}
+
+/* vm_fault() - populates an area on a not-present page fault
+ *
+ * Returns 0 if the address is outside every area, or if the access
+ * is not allowed there.
+ */
+int vm_fault(unsigned long addr, uint32_t err_code) {
+    vma_t * vma = vma_find(vm_space_of(addr), addr);
+    unsigned long page = addr & PAGE_MASK;
+
+    if (!vma || (vma->flags & VMA_FILE))
+        return 0;
+    // Writes need a writable area, user accesses a user one
+    if (((err_code & 0x2) && !(vma->prot & PAGE_WRITE)) ||
+        ((err_code & 0x4) && !(vma->prot & PAGE_USER)))
+        return 0;
+
+    // Grow the stack down to the faulting page
+    if (page < vma->start)
+        vma->start = page;
+
+    mm_map(pm_alloc(), (void *) page, vma->prot | PAGE_WRITE);
+    memset((uint8_t *) page, 0, 0x1000);
+    if (!(vma->prot & PAGE_WRITE))
+        mm_map(get_physaddr((void *) page), (void *) page, vma->prot);
+    return 1;
+}
+
+/* vm_user_access() - tells if ring 3 may access [addr, addr + len)
+ *
+ * Pages not mapped yet pass if an area would populate them on a fault.
+ * Copy-on-write pages count as writable.
+ */
+int vm_user_access(unsigned long addr, unsigned long len, int write) {
+    unsigned long page, end = addr + len;
+    unsigned int flags;
+    vma_t * vma;
+
+    if (end < addr)
+        return 0;
+    for (page = addr & PAGE_MASK; page < end; page += 0x1000) {
+        if ((flags = get_pageflags((void *) page))) {
+            if (!(flags & PAGE_USER) ||
+                (write && !(flags & (PAGE_WRITE | PAGE_COW))))
+                return 0;
+            continue;
+        }
+        vma = vma_find(vm_space_of(page), page);
+        if (!vma || (vma->flags & VMA_FILE) || !(vma->prot & PAGE_USER) ||
+            (write && !(vma->prot & PAGE_WRITE)))
+            return 0;
+    }
+    return 1;
+}
+
+/* vm_user_string() - tells if ring 3 may read a string of up to max
+ * bytes, its terminating NUL included
+ */
+int vm_user_string(const char * str, unsigned long max) {
+    unsigned long addr = (unsigned long) str, left;
+
+    while (max) {
+        if (!vm_user_access(addr, 1, 0))
+            return 0;
+        // Scan up to the end of the page
+        for (left = 0x1000 - (addr & 0xFFF); left && max; left--, max--, addr++)
+            if (!*(const char *) addr)
+                return 1;
+    }
+    return 0;
+}
+
+/* vm_space_of() - the address space an address belongs to
+ *
+ * The kernel half is shared, everything else belongs to the
+ * running address space. Returns NULL if it isn't registered.
+ */
+static vm_space_t * vm_space_of(unsigned long addr) {
+    vm_space_t * space;
+
+    if (addr >= KERNEL_VIRTUAL_BASE)
+        return &sys_base->kernel_space;
+    for (space = (vm_space_t *) get_head((list_head_t *) &sys_base->vm_space_list);
+         space; space = (vm_space_t *) get_next((list_node_t *) space))
+        if (space->page_directory == this_cpu()->act_page_directory)
+            return space;
+    return NULL;
+}
+
+/* vma_find() - the area holding addr, or the stack able to grow over it */
+static vma_t * vma_find(vm_space_t * space, unsigned long addr) {
+    vma_t * vma;
+
+    if (!space)
+        return NULL;
+    for (vma = (vma_t *) get_head((list_head_t *) &space->vma_list); vma;
+         vma = (vma_t *) get_next((list_node_t *) vma))
+        if (addr < vma->end && (addr >= vma->start ||
+            ((vma->flags & VMA_GROWSDOWN) && addr >= vma->limit)))
+            return vma;
+    return NULL;
+}
+
+static vma_t * vma_add(vm_space_t * space, unsigned long start, unsigned long end,
+        unsigned long limit, uint32_t flags, uint32_t prot) {
+    vma_t * vma = (vma_t *) kmalloc(sizeof (vma_t));
+
+    vma->node.type = NT_MEMORY;
+    vma->node.name = NULL;
+    vma->start = start;
+    vma->end = end;
+    vma->limit = limit;
+    vma->flags = flags;
+    vma->prot = prot;
+    add_tail((list_head_t *) &space->vma_list, (list_node_t *) vma);
+    return vma;
+}
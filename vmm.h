@@ -0,0 +1,69 @@
+/*
+ * File:   vmm.h
+ * Author: renato
+ *
+ * Virtual memory areas. Every address space keeps a list of the regions
+ * reserved in it; their pages are only mapped by page_fault() on first
+ * touch. Areas above KERNEL_VIRTUAL_BASE belong to the kernel space,
+ * shared by every address space.
+ */
+
+#ifndef _VMM_H
+#define	_VMM_H
+
+#include "common.h"
+#include "pmm.h"
+
+#define VMA_ANON        1       // Zero-filled pages
+#define VMA_GROWSDOWN   2       // Stack, extended by faults below its start
+#define VMA_FILE        4       // Backed by a file (no file systems yet)
+
+/* Thread stacks are reserved in slots of this window, below the
+ * physical memory map. The kernel heap stops where it starts */
+#define VM_STACK_START  (unsigned long) 0xCC000000
+#define VM_STACK_END    (unsigned long) 0xD0000000
+#define VM_STACK_SLOT   (unsigned long) 0x00100000
+#define VM_STACK_SLOTS  ((VM_STACK_END - VM_STACK_START) / VM_STACK_SLOT)
+
+/*! \brief Virtual memory area descriptor.
+ *
+ * Covers [start, end). A VMA_GROWSDOWN area may grow down to limit,
+ * one page above the guard page of its slot.
+ */
+typedef struct vma {
+    list_node_t node;           //!< Links the area in its space, by address
+    unsigned long start;        //!< First address of the area
+    unsigned long end;          //!< First address past the area
+    unsigned long limit;        //!< Lowest start of a growing stack
+    uint32_t flags;             //!< VMA_* flags
+    uint32_t prot;              //!< PAGE_* flags of the mapped pages
+} __attribute__((packed)) vma_t;
+
+/*! \brief Address space descriptor. */
+typedef struct vm_space {
+    list_node_t node;           //!< Links the space in sys_base->vm_space_list
+    pagedir_t * page_directory; //!< CR3 value of the space
+    list_head_t vma_list;       //!< Areas reserved in the space
+} __attribute__((packed)) vm_space_t;
+
+void vm_init();
+
+vm_space_t * vm_space_create(pagedir_t * page_directory);
+
+vm_space_t * vm_space_clone();
+
+vma_t * vm_map_anon(unsigned long start, unsigned long size, uint32_t prot);
+
+void vm_unmap(vma_t * vma);
+
+void * vm_stack_alloc();
+
+void vm_stack_free(void * top);
+
+int vm_fault(unsigned long addr, uint32_t err_code);
+
+int vm_user_access(unsigned long addr, unsigned long len, int write);
+
+int vm_user_string(const char * str, unsigned long max);
+
+#endif	/* _VMM_H */